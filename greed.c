@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <getopt.h>
 #include <math.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,13 +15,24 @@
 #include <libgjm/debug.h>
 #include <libgjm/util.h>
 
+#include "server/proto.h"
+
 #define MAX_ATTR 7
 #define MAX_GOALS 10
 
+// Session protocol, see server/stream.h
+#define STREAM_PROTOCOL "berghain-stream"
+#define STREAM_REJECT 0
+#define STREAM_ACCEPT 1
+#define STREAM_END 0x80
+
 static char *host = "localhost";
 static char *proto = "https";
+static bool binary = false;
 
 static char *userid = "b7894ec6-7a3b-4646-8890-32f9daa367f8";
+// Seed for the patrons, so that strategies can be compared on the same ones
+static char *seed = NULL;
 static char gameid[40];
 static uint32_t personid = 0;
 
@@ -328,6 +340,7 @@ void update_goals(struct person *p, struct goals *goals) {
 }
 
 static char body[65535];
+static size_t body_len = 0;
 
 /**
  * Only one request at a time so save the response into a single buffer
@@ -341,12 +354,48 @@ size_t save_body(char *ptr, size_t size, size_t nmemb, void *data) {
 	}
 	memcpy(body, ptr, nmemb*size);
 	body[nmemb*size] = '\0';
+	body_len = nmemb*size;
 	return nmemb*size;
 }
 
+/**
+ * Fill in a person from the attribute bits the server sent for them
+ */
+void set_person(struct person *p, uint32_t attrs) {
+	p->n = 0;
+
+	for (size_t i = 0; i < MAX_ATTR; ++i) {
+		if (is_flag_set(attrs, BIT(i))) {
+			p->attr[p->n] = i;
+			p->n += 1;
+		}
+	}
+
+	DEBUG("new person received with %zu attributes:", p->n);
+	for (size_t i = 0; i < p->n; ++i) {
+		DEBUG(" %zu", p->attr[i]);
+	}
+	DEBUG("\n");
+}
+
+/**
+ * Double check that we agree on how many were admitted
+ */
+void check_count(uint32_t current, bool first) {
+	if (!first) {
+		if (current != personid) {
+			ERROR("expected count %u, got %u\n", personid, current);
+			dump_exit();
+		}
+	}
+	else if (current != 0) {
+		ERROR("expected first person's count of 0 got %u\n", current);
+		dump_exit();
+	}
+}
+
 bool parse_person(struct person *p, bool first) {
 	char *s;
-	uint32_t current;
 
 	ERROR("current body: %s\n", body);
 
@@ -372,46 +421,23 @@ bool parse_person(struct person *p, bool first) {
 	while (!isdigit(*s))
 		s++;
 
-	current = atoi(s);
-	if (!first) {
-		if (current != personid) {
-			ERROR("expected count %u, got %u\n", personid, current);
-			dump_exit();
-		}
-	}
-	else if (current != 0) {
-		ERROR("expected first person's count of 0 got %u\n", current);
-		dump_exit();
-	}
+	check_count(atoi(s), first);
 
 	// Read attributes for next patron
 	s = strstr(s, "\"next\"");
 	while (!isdigit(*s))
 		s++;
 
-	p->n = 0;
-
-	current = atoi(s);
-	for (size_t i = 0; i < MAX_ATTR; ++i) {
-		if (is_flag_set(current, BIT(i))) {
-			p->attr[p->n] = i;
-			p->n += 1;
-		}
-	}
-
-	DEBUG("new person received with %zu attributes:", p->n);
-	for (size_t i = 0; i < p->n; ++i) {
-		DEBUG(" %zu", p->attr[i]);
-	}
-	DEBUG("\n");
-
+	set_person(p, atoi(s));
 	return true;
 }
 
-void new_game(int type) {
+/**
+ * Retrieve the parameters for a game type from the JSON api
+ */
+void get_params(int type) {
 	char urlbuf[256];
 	char *s;
-	char *e;
 	CURLcode res;
 	size_t attr_used;
 	size_t i, j;
@@ -562,11 +588,122 @@ void new_game(int type) {
 	}
 
 	all_goals->n = i;
+}
+
+/**
+ * Make sure a reply from one of the /bin/ routes is binary, since errors are JSON
+ */
+void check_bin_reply(const char *what, size_t len) {
+	char *type = NULL;
+
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &type);
+	if (!type || strcmp(type, BIN_CONTENT_TYPE) != 0) {
+		ERROR("%s failed: %s\n", what, body);
+		dump_exit();
+	}
+
+	if (body_len < len) {
+		ERROR("%s reply too short: %zu bytes\n", what, body_len);
+		dump_exit();
+	}
+}
+
+/**
+ * Retrieve the parameters for a game type in the layout from server/proto.h
+ */
+void get_params_bin(int type) {
+	const uint8_t *buf = (const uint8_t *) body;
+	char urlbuf[256];
+	CURLcode res;
+	size_t n, n_goals, pos, i;
+
+	snprintf(urlbuf, sizeof(urlbuf),
+		"%s://%s/game/bin/params?type=%d",
+		proto, host, type);
+
+	curl_easy_setopt(curl, CURLOPT_URL, urlbuf);
+	res = curl_easy_perform(curl);
+
+	if (res != CURLE_OK) {
+		ERROR("failed to retrieve game parameters: CURLcode = %d\n", res);
+		dump_exit();
+	}
+
+	check_bin_reply("game parameters", BIN_PARAMS_LEN(0));
+	n = buf[1];
+	n_goals = buf[2];
+
+	if (n > MAX_ATTR || n_goals > MAX_GOALS) {
+		ERROR("game has %zu attributes and %zu goals, too many\n", n, n_goals);
+		dump_exit();
+	}
+	check_bin_reply("game parameters", BIN_PARAMS_LEN(n));
+
+	for (i = 0; i < n; ++i) {
+		__p[i] = bin_get_f32(buf + 4 + 4*i);
+	}
+
+	for (i = 0; i < n*n; ++i) {
+		__r[i / n][i % n] = bin_get_f32(buf + 4 + 4*n + 4*i);
+	}
+
+	all_goals = alloc_goals();
+	all_goals->space = 1000;
+
+	// As with json we only understand >= attr[x] k
+	pos = BIN_PARAMS_LEN(n);
+	for (i = 0; i < n_goals; ++i) {
+		uint16_t oper, attr, num;
+
+		check_bin_reply("game parameters", pos + 1);
+		if (buf[pos] != 3) {
+			ERROR("don't understand goals with %u terms\n", buf[pos]);
+			dump_exit();
+		}
+		check_bin_reply("game parameters", pos + 7);
+
+		oper = bin_get_u16(buf + pos + 1);
+		attr = bin_get_u16(buf + pos + 3);
+		num = bin_get_u16(buf + pos + 5);
+
+		if (oper != GOAL_OPER_GE) {
+			ERROR("don't understand goals with operator %d\n", oper);
+			dump_exit();
+		}
+
+		if (!is_flag_set(attr, GOAL_ATTR_BIT)) {
+			ERROR("second goal term isn't an attribute: %d\n", attr);
+			dump_exit();
+		}
+
+		if (num != GOAL_VALUE(num)) {
+			ERROR("final goal term isn't a constant: %d\n", num);
+			dump_exit();
+		}
+
+		all_goals->g[i]->attr = GOAL_VALUE(attr);
+		all_goals->g[i]->num = num;
+		pos += 7;
+	}
+
+	all_goals->n = n_goals;
+}
+
+void new_game(int type) {
+	char urlbuf[256];
+	char *s;
+	char *e;
+	CURLcode res;
+
+	if (binary)
+		get_params_bin(type);
+	else
+		get_params(type);
 
 	// Set up new game and get game uuid
 	snprintf(urlbuf, sizeof(urlbuf),
-		"%s://%s/game/new-game?user=%s&type=%d",
-		proto, host, userid, type);
+		"%s://%s/game/new-game?user=%s&type=%d%s%s",
+		proto, host, userid, type, seed ? "&seed=" : "", seed ? seed : "");
 
 	curl_easy_setopt(curl, CURLOPT_URL, urlbuf);
 	res = curl_easy_perform(curl);
@@ -589,19 +726,38 @@ void new_game(int type) {
 	DEBUG("new game uuid: %s\n", gameid);
 }
 
+/**
+ * Read a /bin/process-person reply, see server/proto.h
+ */
+bool parse_person_bin(struct person *p, bool first) {
+	const uint8_t *buf = (const uint8_t *) body;
+
+	check_bin_reply("process person", BIN_GAME_LEN);
+
+	if (buf[0] != BIN_RUNNING) {
+		DEBUG("status for being done: %u\n", buf[0]);
+		return false;
+	}
+
+	check_count(bin_get_u32(buf + 4), first);
+	set_person(p, buf[1]);
+	return true;
+}
+
 bool get_person(struct person *p, bool action, bool first) {
+	const char *route = binary ? "bin/process-person" : "process-person";
 	char urlbuf[256];
 	CURLcode res;
 
 	if (first) {
 		snprintf(urlbuf, sizeof(urlbuf),
-		"%s://%s/game/process-person?game=%s&person=%d",
-		proto, host, gameid, personid);
+		"%s://%s/game/%s?game=%s&person=%d",
+		proto, host, route, gameid, personid);
 	}
 	else {
 		snprintf(urlbuf, sizeof(urlbuf),
-		"%s://%s/game/process-person?game=%s&person=%d&verdict=%s",
-			proto, host, gameid, personid, action ? "true" : "false");
+		"%s://%s/game/%s?game=%s&person=%d&verdict=%s",
+			proto, host, route, gameid, personid, action ? "true" : "false");
 		personid = personid + 1;
 	}
 
@@ -615,19 +771,188 @@ bool get_person(struct person *p, bool action, bool first) {
 		dump_exit();
 	}
 
+	if (binary)
+		return parse_person_bin(p, first);
 	return parse_person(p, first);
 }
 
+// Bytes received on the session connection that have not been used yet
+static uint8_t stream_buf[4096];
+static size_t stream_pos = 0;
+static size_t stream_len = 0;
+
+/**
+ * curl_easy_send and curl_easy_recv don't block, so wait on the socket ourselves
+ */
+void stream_wait(bool for_send) {
+	curl_socket_t sock;
+	struct pollfd pfd;
+
+	if (curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK) {
+		ERROR("lost the session socket\n");
+		dump_exit();
+	}
+
+	pfd.fd = sock;
+	pfd.events = for_send ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	poll(&pfd, 1, -1);
+}
+
+void stream_write(const void *buf, size_t len) {
+	const char *pos = buf;
+	CURLcode res;
+	size_t sent;
+
+	while (len > 0) {
+		res = curl_easy_send(curl, pos, len, &sent);
+		if (res == CURLE_AGAIN) {
+			stream_wait(true);
+			continue;
+		}
+
+		if (res != CURLE_OK) {
+			ERROR("failed to send on session: CURLcode = %d\n", res);
+			dump_exit();
+		}
+
+		pos += sent;
+		len -= sent;
+	}
+}
+
+/**
+ * Read whatever is available into the buffer, waiting for at least one byte
+ */
+void stream_fill(void) {
+	CURLcode res;
+	size_t got;
+
+	while (true) {
+		res = curl_easy_recv(curl, stream_buf + stream_len,
+			sizeof(stream_buf) - stream_len, &got);
+		if (res == CURLE_AGAIN) {
+			stream_wait(false);
+			continue;
+		}
+
+		if (res != CURLE_OK || got == 0) {
+			ERROR("session closed by server: CURLcode = %d\n", res);
+			dump_exit();
+		}
+
+		stream_len += got;
+		return;
+	}
+}
+
+uint8_t stream_next(void) {
+	if (stream_pos == stream_len) {
+		stream_pos = 0;
+		stream_len = 0;
+		stream_fill();
+	}
+
+	return stream_buf[stream_pos++];
+}
+
+/**
+ * Connect with curl but speak the upgrade ourselves, then keep the connection as
+ * a session for the game. Anything after the 101 reply headers is session data.
+ */
+void open_stream(void) {
+	char urlbuf[256];
+	char req[512];
+	char *end;
+	CURLcode res;
+
+	snprintf(urlbuf, sizeof(urlbuf), "%s://%s/game/stream", proto, host);
+
+	curl_easy_setopt(curl, CURLOPT_URL, urlbuf);
+	curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+
+	res = curl_easy_perform(curl);
+	if (res != CURLE_OK) {
+		ERROR("failed to connect for session: CURLcode = %d\n", res);
+		dump_exit();
+	}
+
+	snprintf(req, sizeof(req),
+		"GET /game/stream?game=%s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"Connection: Upgrade\r\n"
+		"Upgrade: " STREAM_PROTOCOL "\r\n"
+		"\r\n",
+		gameid, host);
+	stream_write(req, strlen(req));
+
+	// Headers are text, so keep the buffer terminated while looking for their end
+	while (true) {
+		stream_fill();
+		if (stream_len == sizeof(stream_buf)) {
+			ERROR("session reply headers too long\n");
+			dump_exit();
+		}
+		stream_buf[stream_len] = '\0';
+
+		end = strstr((char *) stream_buf, "\r\n\r\n");
+		if (end)
+			break;
+	}
+
+	if (strncmp((char *) stream_buf, "HTTP/1.1 101", 12) != 0) {
+		ERROR("server refused session: %s\n", stream_buf);
+		dump_exit();
+	}
+
+	stream_pos = (end + 4) - (char *) stream_buf;
+	DEBUG("session open for game %s\n", gameid);
+}
+
+/**
+ * Play the game over a session, one byte each way per patron
+ */
+void play_stream(void) {
+	struct person p;
+	uint8_t frame;
+	bool choice;
+
+	open_stream();
+
+	while (true) {
+		frame = stream_next();
+		if (frame & STREAM_END) {
+			DEBUG("session ended with status %u\n", frame & ~STREAM_END);
+			dump_exit();
+		}
+
+		set_person(&p, frame);
+		choice = decide_for(&p, all_goals);
+		if (choice)
+			update_goals(&p, all_goals);
+
+		frame = choice ? STREAM_ACCEPT : STREAM_REJECT;
+		stream_write(&frame, 1);
+		personid += 1;
+	}
+}
+
 void help(void) {
 	ERROR("\n");
-	ERROR(" Usage: ./greed [-h] [-i] [-6] [-H host] [-u uuid] [-t id]\n");
+	ERROR(" Usage: ./greed [-h] [-i] [-s] [-b] [-6] [-H host] [-u uuid] [-t id]\n");
+	ERROR("                [-S seed]\n");
 	ERROR("\n");
 	ERROR("   -h          Display help information\n");
 	ERROR("   -i          Use http  to connect (default: https)\n");
+	ERROR("   -s          Play over a single session connection\n");
+	ERROR("   -b          Use the binary api instead of json\n");
 	ERROR("   -H host     Connect to host (default: localhost)\n");
 	ERROR("   -6          Use ipv6 to resolve and connect to host\n");
 	ERROR("   -u uuid     Use uuid as the user id (default: %s)\n", userid);
 	ERROR("   -t id       Use id as the game type (default: 0)\n");
+	ERROR("   -S seed     Play the patrons drawn from seed (default: random)\n");
 	ERROR("\n");
 	exit(1);
 }
@@ -638,8 +963,9 @@ int main(int argc, char **argv) {
 	int type = 0;
 	bool choice, first;
 	bool ipv6 = false;
+	bool stream = false;
 
-	while ((opt = getopt(argc, argv, "hi6u:H:t:")) != -1) {
+	while ((opt = getopt(argc, argv, "hisb6u:H:t:S:")) != -1) {
 		switch (opt) {
 		case 'h': /* fallthrough */
 		default:
@@ -649,6 +975,14 @@ int main(int argc, char **argv) {
 			DEBUG("proto https -> http\n");
 			proto = "http";
 			break;
+		case 's':
+			DEBUG("playing over a session\n");
+			stream = true;
+			break;
+		case 'b':
+			DEBUG("using the binary api\n");
+			binary = true;
+			break;
 		case 'H':
 			DEBUG("connecting to host `%s`\n", optarg);
 			host = optarg;
@@ -669,6 +1003,10 @@ int main(int argc, char **argv) {
 			type = atoi(optarg);
 			DEBUG("running game type %d\n", type);
 			break;
+		case 'S':
+			DEBUG("using seed %s\n", optarg);
+			seed = optarg;
+			break;
 		}
 	}
 
@@ -689,6 +1027,9 @@ int main(int argc, char **argv) {
 
 	new_game(type);
 
+	if (stream)
+		play_stream();
+
 	choice = false;
 	first = true;
 	while (true) {
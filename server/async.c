@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libgjm/debug.h>
+#include <libgjm/util.h>
+
+#include "async.h"
+
+/**
+ * A single event loop thread serves both MHD, running in external epoll mode, and
+ * one asynchronous valkey connection. Requests that need valkey queue a command,
+ * suspend their connection, and are resumed from the reply callback, so the number
+ * of requests in flight is limited by memory rather than threads or pool size.
+ * Everything here, including the reply callbacks, runs on the loop thread.
+ */
+static int epfd = -1;
+static int wakefd = -1;
+static int mhd_fd = -1;
+static struct MHD_Daemon *mhd;
+static pthread_t loop_thread;
+static volatile bool running;
+
+static valkeyAsyncContext *ac;
+static int vk_fd = -1;
+static uint32_t vk_events;
+static uint64_t reconnect_at;
+
+static struct valkey_script *scripts[ASYNC_MAX_SCRIPTS];
+static size_t n_scripts;
+
+static uint64_t now_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Adapter between libvalkey and our epoll set: libvalkey says which directions it
+ * wants to hear about and we keep the registration for its socket in step
+ */
+static void set_events(uint32_t events) {
+	struct epoll_event ev = {
+		.events = events,
+		.data.fd = vk_fd,
+	};
+
+	if (vk_fd < 0 || events == vk_events)
+		return;
+
+	if (events == 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, vk_fd, NULL);
+	else if (vk_events == 0)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, vk_fd, &ev);
+	else
+		epoll_ctl(epfd, EPOLL_CTL_MOD, vk_fd, &ev);
+
+	vk_events = events;
+}
+
+static void add_read(void *priv) {
+	UNUSED(priv);
+	set_events(vk_events | EPOLLIN);
+}
+
+static void del_read(void *priv) {
+	UNUSED(priv);
+	set_events(vk_events & ~EPOLLIN);
+}
+
+static void add_write(void *priv) {
+	UNUSED(priv);
+	set_events(vk_events | EPOLLOUT);
+}
+
+static void del_write(void *priv) {
+	UNUSED(priv);
+	set_events(vk_events & ~EPOLLOUT);
+}
+
+static void cleanup(void *priv) {
+	UNUSED(priv);
+	set_events(0);
+	vk_fd = -1;
+}
+
+static void on_script_loaded(valkeyAsyncContext *c, void *r, void *priv) {
+	valkeyReply *reply = r;
+	struct valkey_script *script = priv;
+
+	UNUSED(c);
+	if (!reply || reply->type == VALKEY_REPLY_ERROR)
+		ERROR("failed to load script %s on async connection\n", script->sha);
+}
+
+static void on_connect(valkeyAsyncContext *c, int status) {
+	if (status != VALKEY_OK) {
+		ERROR("async valkey connection failed: %s\n", c->errstr);
+		ac = NULL;
+		reconnect_at = now_ms() + ASYNC_RECONNECT_MS;
+		return;
+	}
+
+	DEBUG("async valkey connection ready\n");
+}
+
+static void on_disconnect(const valkeyAsyncContext *c, int status) {
+	UNUSED(c);
+
+	if (status != VALKEY_OK)
+		ERROR("lost async valkey connection\n");
+
+	ac = NULL;
+	reconnect_at = now_ms() + ASYNC_RECONNECT_MS;
+}
+
+/**
+ * Open the async connection and queue the loading of every registered script, so
+ * that scripts are always in place before any command that runs them, including
+ * after valkey restarts and we reconnect
+ */
+static void async_connect(void) {
+	ac = valkeyAsyncConnectUnix(VALKEY_SOCKET_PATH);
+	if (!ac || ac->err) {
+		ERROR("failed to start async valkey connection: %s\n",
+			ac ? ac->errstr : "out of memory");
+		if (ac)
+			valkeyAsyncFree(ac);
+		ac = NULL;
+		reconnect_at = now_ms() + ASYNC_RECONNECT_MS;
+		return;
+	}
+
+	vk_fd = ac->c.fd;
+	vk_events = 0;
+	ac->ev.addRead = add_read;
+	ac->ev.delRead = del_read;
+	ac->ev.addWrite = add_write;
+	ac->ev.delWrite = del_write;
+	ac->ev.cleanup = cleanup;
+
+	// Setting the connect callback waits for writability, which needs the adapter
+	valkeyAsyncSetConnectCallback(ac, on_connect);
+	valkeyAsyncSetDisconnectCallback(ac, on_disconnect);
+
+	for (size_t i = 0; i < n_scripts; ++i) {
+		valkeyAsyncCommand(ac, on_script_loaded, scripts[i], "SCRIPT LOAD %s",
+			scripts[i]->source);
+	}
+}
+
+static void *async_loop(void *arg) {
+	struct epoll_event events[ASYNC_MAX_EVENTS];
+	MHD_UNSIGNED_LONG_LONG mhd_timeout;
+	int timeout, n;
+
+	UNUSED(arg);
+
+	while (running) {
+		if (!ac && now_ms() >= reconnect_at)
+			async_connect();
+
+		timeout = ASYNC_RECONNECT_MS;
+		if (MHD_get_timeout(mhd, &mhd_timeout) == MHD_YES && mhd_timeout < ASYNC_RECONNECT_MS)
+			timeout = (int) mhd_timeout;
+
+		n = epoll_wait(epfd, events, ASYNC_MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			ERROR("epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			uint32_t ev = events[i].events;
+
+			// A callback for an earlier event may have dropped the connection
+			if (!ac || fd != vk_fd)
+				continue;
+
+			if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				valkeyAsyncHandleRead(ac);
+			if (ac && (ev & EPOLLOUT))
+				valkeyAsyncHandleWrite(ac);
+		}
+
+		// Always run MHD, both for its own sockets and to pick up any connection
+		// resumed by a valkey callback above
+		MHD_run(mhd);
+	}
+
+	if (ac)
+		valkeyAsyncFree(ac);
+	ac = NULL;
+	return NULL;
+}
+
+/**
+ * Start the event loop for a daemon started with MHD_USE_EPOLL and
+ * MHD_ALLOW_SUSPEND_RESUME but without an internal thread
+ */
+error_t *async_start(struct MHD_Daemon *daemon) {
+	const union MHD_DaemonInfo *info;
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	mhd = daemon;
+	info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_EPOLL_FD);
+	if (!info)
+		return E_MSG("mhd daemon has no epoll fd");
+	mhd_fd = info->epoll_fd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return E_MSG("failed to create epoll fd");
+
+	wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakefd < 0)
+		return E_MSG("failed to create eventfd");
+
+	// MHD's own epoll set nests inside ours
+	ev.data.fd = mhd_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, mhd_fd, &ev);
+	ev.data.fd = wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+	running = true;
+	if (pthread_create(&loop_thread, NULL, async_loop, NULL) != 0) {
+		running = false;
+		return E_MSG("failed to start event loop");
+	}
+
+	return OK;
+}
+
+void async_stop(void) {
+	uint64_t one = 1;
+
+	running = false;
+	if (write(wakefd, &one, sizeof(one)) < 0)
+		ERROR("failed to wake event loop\n");
+
+	pthread_join(loop_thread, NULL);
+	close(wakefd);
+	close(epfd);
+}
+
+/**
+ * Have a script loaded whenever the async connection is made, before async_start()
+ */
+void async_register_script(struct valkey_script *script) {
+	ASSERT(n_scripts < ASYNC_MAX_SCRIPTS);
+	scripts[n_scripts++] = script;
+}
+
+/**
+ * Queue a command on the async connection, with fn called on the loop thread once
+ * the reply arrives. The reply is NULL if the connection was lost first. Returns
+ * false if the command could not be queued, in which case fn is never called.
+ */
+bool async_command(valkeyCallbackFn *fn, void *priv, const char *fmt, ...) {
+	va_list args;
+	bool ret;
+
+	va_start(args, fmt);
+	ret = async_vcommand(fn, priv, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+bool async_vcommand(valkeyCallbackFn *fn, void *priv, const char *fmt, va_list args) {
+	if (!ac)
+		return false;
+
+	return valkeyvAsyncCommand(ac, fn, priv, fmt, args) == VALKEY_OK;
+}
+
+/**
+ * Queue a run of a registered script, as with valkey_eval(). The script was loaded
+ * when the connection was made so it is always run by digest.
+ */
+bool async_eval(valkeyCallbackFn *fn, void *priv, struct valkey_script *script,
+	int nkeys, int argc, const char **argv, const size_t *argvlen)
+{
+	const char *cmd[argc + 3];
+	size_t cmdlen[argc + 3];
+	char nkeys_str[16];
+
+	if (!ac)
+		return false;
+
+	snprintf(nkeys_str, sizeof(nkeys_str), "%d", nkeys);
+
+	cmd[0] = "EVALSHA";
+	cmd[1] = script->sha;
+	cmd[2] = nkeys_str;
+	cmdlen[0] = strlen(cmd[0]);
+	cmdlen[1] = strlen(cmd[1]);
+	cmdlen[2] = strlen(cmd[2]);
+
+	for (int i = 0; i < argc; ++i) {
+		cmd[3 + i] = argv[i];
+		cmdlen[3 + i] = argvlen[i];
+	}
+
+	return valkeyAsyncCommandArgv(ac, fn, priv, argc + 3, cmd, cmdlen) == VALKEY_OK;
+}
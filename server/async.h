@@ -0,0 +1,31 @@
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include <microhttpd.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <valkey/async.h>
+
+#include <libgjm/errors.h>
+
+#include "valkey.h"
+
+// Events handled per wakeup of the loop
+#define ASYNC_MAX_EVENTS 64
+
+// While valkey is unreachable a new connection is attempted this often
+#define ASYNC_RECONNECT_MS 1000
+
+// Most scripts that can be loaded on the async connection
+#define ASYNC_MAX_SCRIPTS 4
+
+error_t *async_start(struct MHD_Daemon *daemon);
+void async_stop(void);
+
+void async_register_script(struct valkey_script *script);
+bool async_command(valkeyCallbackFn *fn, void *priv, const char *fmt, ...);
+bool async_vcommand(valkeyCallbackFn *fn, void *priv, const char *fmt, va_list args);
+bool async_eval(valkeyCallbackFn *fn, void *priv, struct valkey_script *script,
+	int nkeys, int argc, const char **argv, const size_t *argvlen);
+
+#endif
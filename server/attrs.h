@@ -0,0 +1,7 @@
+#ifndef _ATTRS_H_
+#define _ATTRS_H_
+
+// Maximum number of attrs permitted
+#define MAX_ATTRS 7
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Requests per second for each server mode, using wrk against a local valkey. Run
+# from the directory with the berghain-server binary, with valkey already started
+# and nothing else listening on the game port:
+#   $ server/bench-modes.sh [duration] [connections] [modes...]
+#
+# Each mode is measured on /params, which never touches valkey, on /details, which
+# reads a game through the cache and valkey, and on /process-person without a
+# verdict, which is the route served asynchronously in async mode.
+
+DURATION=${1:-10s}
+CONNS=${2:-256}
+shift $(( $# < 2 ? $# : 2 ))
+MODES=${@:-select conn pool async}
+
+URL=http://localhost:8124
+THREADS=$(nproc)
+
+if ! command -v wrk > /dev/null; then
+	echo "wrk is required for the benchmark"
+	exit 1
+fi
+
+run() {
+	local rps
+	rps=$(wrk -t "$THREADS" -c "$CONNS" -d "$DURATION" "$URL$1" | awk '/Requests\/sec/ {print $2}')
+	printf "  %-16s %12s req/s\n" "$2" "$rps"
+}
+
+for mode in $MODES; do
+	# The server quits on q from stdin, so keep it open until we are done with it
+	mkfifo bench-modes.fifo
+	./berghain-server -m "$mode" -c 4096 -p "$THREADS" < bench-modes.fifo > /dev/null 2>&1 &
+	server=$!
+	exec 3> bench-modes.fifo
+	sleep 1
+
+	user=$(curl -s "$URL/new-user?name=bench$RANDOM$RANDOM" | sed -e 's/.*"uuid":"\([^"]*\)".*/\1/')
+	game=$(curl -s "$URL/new-game?user=$user&type=0" | sed -e 's/.*"id":"\([^"]*\)".*/\1/')
+
+	echo "$mode:"
+	run "/params?type=0" "params"
+	run "/details?game=$game" "details"
+	run "/process-person?game=$game&person=0" "process-person"
+
+	echo q >&3
+	exec 3>&-
+	wait $server
+	rm -f bench-modes.fifo
+done
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <time.h>
+
+#include <libgjm/errors.h>
+
+#include "game.h"
+#include "normals.h"
+
+#define BENCH_NORMAL_COUNT 20000000
+#define BENCH_ATTR_COUNT 10000000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, size_t count, double elapsed, double base) {
+	printf("  %-28s %8.2f M/s", name, count / elapsed / 1e6);
+	if (base > 0)
+		printf("  (%.2fx)", base / elapsed);
+	printf("\n");
+}
+
+/**
+ * Throughput of the scalar get_normals() path against the bulk generator
+ */
+void bench_normals(void) {
+	size_t i;
+	double *data;
+	double start, scalar, bulk;
+
+	data = calloc(BENCH_NORMAL_COUNT, sizeof(*data));
+	ASSERT(data);
+
+	start = now();
+	for (i = 0; i < BENCH_NORMAL_COUNT/2; ++i) {
+		get_normals(&data[2*i], &data[2*i+1]);
+	}
+	scalar = now() - start;
+
+	start = now();
+	get_normals_bulk(data, BENCH_NORMAL_COUNT);
+	bulk = now() - start;
+
+	printf("normals (%d):\n", BENCH_NORMAL_COUNT);
+	report("get_normals", BENCH_NORMAL_COUNT, scalar, 0);
+	report("get_normals_bulk", BENCH_NORMAL_COUNT, bulk, scalar);
+
+	free(data);
+}
+
+/**
+ * Throughput of each way to generate patrons for one set of game parameters
+ */
+void bench_attributes(int id, struct game_params_t *params) {
+	size_t i;
+	uint8_t *attrs;
+	double start, scalar, bulk, alias;
+
+	attrs = calloc(BENCH_ATTR_COUNT, sizeof(*attrs));
+	ASSERT(attrs);
+
+	start = now();
+	for (i = 0; i < BENCH_ATTR_COUNT; ++i) {
+		attrs[i] = generate_attributes(params->rng_params.n, params->rng_params.t,
+			params->rng_params.a);
+	}
+	scalar = now() - start;
+
+	start = now();
+	generate_attributes_bulk(params, attrs, BENCH_ATTR_COUNT);
+	bulk = now() - start;
+
+	start = now();
+	for (i = 0; i < BENCH_ATTR_COUNT; ++i) {
+		attrs[i] = generate_person(params);
+	}
+	alias = now() - start;
+
+	printf("attributes, game %d (%zu attrs, %d patrons):\n", id, params->rng_params.n,
+		BENCH_ATTR_COUNT);
+	report("generate_attributes", BENCH_ATTR_COUNT, scalar, 0);
+	report("generate_attributes_bulk", BENCH_ATTR_COUNT, bulk, scalar);
+	report("generate_person", BENCH_ATTR_COUNT, alias, scalar);
+
+	free(attrs);
+}
+
+int main(int argc, char **argv) {
+	error_t *ret;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	ret = init_game_params();
+	if (NOT_OK(ret)) {
+		error_print(ret);
+		exit(1);
+	}
+
+	bench_normals();
+	for (size_t i = 0; i < get_number_of_games(); ++i) {
+		printf("\n");
+		bench_attributes(i, get_game_params(i));
+	}
+
+	return 0;
+}
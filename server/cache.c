@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgjm/util.h>
+
+#include "cache.h"
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct game_cache_entry *entries[GAME_CACHE_SHARD_SIZE];
+};
+
+static struct cache_shard shards[GAME_CACHE_SHARDS];
+
+/**
+ * Unlocked single threaded cache initializer
+ */
+void init_game_cache(void) {
+	for (size_t i = 0; i < GAME_CACHE_SHARDS; ++i) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		memset(shards[i].entries, 0, sizeof(shards[i].entries));
+	}
+}
+
+/**
+ * uuids are random so any of their bytes spread games evenly
+ */
+static struct cache_shard *get_shard(const uuid_t id) {
+	uint32_t h;
+
+	memcpy(&h, id, sizeof(h));
+	return &shards[h % GAME_CACHE_SHARDS];
+}
+
+static void free_entry(struct game_cache_entry *entry) {
+	free(entry->game.seen);
+	pthread_mutex_destroy(&entry->lock);
+	free(entry);
+}
+
+/**
+ * Pick a slot for a new entry with the shard locked: an empty one if possible,
+ * otherwise the least recently used entry that nobody holds, preferring stale and
+ * idle entries. Returns GAME_CACHE_SHARD_SIZE if every entry is in use.
+ */
+static size_t find_slot(struct cache_shard *shard, time_t now) {
+	size_t victim = GAME_CACHE_SHARD_SIZE;
+	time_t oldest = now + 1;
+
+	for (size_t i = 0; i < GAME_CACHE_SHARD_SIZE; ++i) {
+		struct game_cache_entry *entry = shard->entries[i];
+
+		if (!entry)
+			return i;
+
+		if (entry->refs > 0)
+			continue;
+
+		if (entry->stale || now - entry->last_used > GAME_CACHE_IDLE_SECONDS)
+			return i;
+
+		if (entry->last_used < oldest) {
+			oldest = entry->last_used;
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+/**
+ * Look up a game, returning its entry referenced and locked, or NULL if it is not
+ * cached. The caller must check stale once the lock is held because the previous
+ * holder may have dropped it while we waited.
+ */
+struct game_cache_entry *game_cache_acquire(const uuid_t id) {
+	struct cache_shard *shard = get_shard(id);
+	struct game_cache_entry *entry = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	for (size_t i = 0; i < GAME_CACHE_SHARD_SIZE; ++i) {
+		struct game_cache_entry *e = shard->entries[i];
+
+		if (e && !e->stale && uuid_compare(e->id, id) == 0) {
+			entry = e;
+			entry->refs += 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (entry)
+		pthread_mutex_lock(&entry->lock);
+
+	return entry;
+}
+
+/**
+ * Add a freshly loaded game, taking ownership of its history. The new entry is
+ * returned referenced and locked, as with game_cache_acquire(). If another request
+ * loaded the same game first, its entry is returned instead and ours is discarded,
+ * unless that entry was dropped while we waited for it, in which case ours replaces
+ * it. Returns NULL without taking ownership if the shard has no room.
+ */
+struct game_cache_entry *game_cache_insert(const uuid_t id, struct game_t *game) {
+	struct cache_shard *shard = get_shard(id);
+	struct game_cache_entry *entry;
+	time_t now = time(NULL);
+	size_t slot;
+
+retry:
+	pthread_mutex_lock(&shard->lock);
+
+	for (size_t i = 0; i < GAME_CACHE_SHARD_SIZE; ++i) {
+		entry = shard->entries[i];
+
+		if (entry && !entry->stale && uuid_compare(entry->id, id) == 0) {
+			entry->refs += 1;
+			pthread_mutex_unlock(&shard->lock);
+
+			// Our copy is only thrown away once the other one is known to be good
+			pthread_mutex_lock(&entry->lock);
+			if (entry->stale) {
+				game_cache_release(entry, true);
+				goto retry;
+			}
+
+			free(game->seen);
+			game->seen = NULL;
+			return entry;
+		}
+	}
+
+	slot = find_slot(shard, now);
+	if (slot == GAME_CACHE_SHARD_SIZE) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+
+	if (shard->entries[slot])
+		free_entry(shard->entries[slot]);
+
+	uuid_copy(entry->id, id);
+	pthread_mutex_init(&entry->lock, NULL);
+	entry->refs = 1;
+	entry->last_used = now;
+	entry->game = *game;
+	entry->game.entry = NULL;
+
+	// Nobody else can see the entry yet so this lock is uncontended
+	pthread_mutex_lock(&entry->lock);
+	shard->entries[slot] = entry;
+	pthread_mutex_unlock(&shard->lock);
+	return entry;
+}
+
+/**
+ * Unlock and drop our reference to an entry. With drop set the entry is marked stale
+ * so that it is not handed out again, and it is freed once nobody references it.
+ */
+void game_cache_release(struct game_cache_entry *entry, bool drop) {
+	struct cache_shard *shard = get_shard(entry->id);
+
+	if (drop)
+		entry->stale = true;
+	pthread_mutex_unlock(&entry->lock);
+
+	pthread_mutex_lock(&shard->lock);
+	entry->refs -= 1;
+	entry->last_used = time(NULL);
+
+	if (entry->refs == 0 && entry->stale) {
+		for (size_t i = 0; i < GAME_CACHE_SHARD_SIZE; ++i) {
+			if (shard->entries[i] == entry) {
+				shard->entries[i] = NULL;
+				break;
+			}
+		}
+
+		free_entry(entry);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Let other requests at an entry while keeping our reference, for a request that
+ * is waiting on valkey and will lock it again with game_cache_lock()
+ */
+void game_cache_unlock(struct game_cache_entry *entry) {
+	pthread_mutex_unlock(&entry->lock);
+}
+
+void game_cache_lock(struct game_cache_entry *entry) {
+	pthread_mutex_lock(&entry->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include <uuid/uuid.h>
+
+#include "game.h"
+
+// Cache geometry, games are spread over shards by uuid and each shard holds a
+// fixed number of games
+#define GAME_CACHE_SHARDS 32
+#define GAME_CACHE_SHARD_SIZE 32
+
+// Games that have not been touched for this long are dropped when space is needed
+#define GAME_CACHE_IDLE_SECONDS 300
+
+/**
+ * A cached game. refs counts every request holding or waiting for the entry, and
+ * the game itself may only be read or changed with lock held. Stale entries are
+ * never handed out again and are freed once the last reference goes away.
+ */
+struct game_cache_entry {
+	uuid_t id;
+	pthread_mutex_t lock;
+	uint32_t refs;
+	time_t last_used;
+	bool stale;
+	struct game_t game;
+};
+
+void init_game_cache(void);
+struct game_cache_entry *game_cache_acquire(const uuid_t id);
+struct game_cache_entry *game_cache_insert(const uuid_t id, struct game_t *game);
+void game_cache_release(struct game_cache_entry *entry, bool drop);
+void game_cache_unlock(struct game_cache_entry *entry);
+void game_cache_lock(struct game_cache_entry *entry);
+
+#endif
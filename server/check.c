@@ -4,6 +4,7 @@
 #include <libgjm/errors.h>
 
 #include "game.h"
+#include "normals.h"
 
 #define NORMAL_TEST_COUNT 10000000
 
@@ -15,20 +16,13 @@
  * Of course these are estimated from the data so really the result we want is "small"
  * This doesn't check that they're independent
  */
-void check_normals(void) {
+void print_moments(const char *name, double *data) {
 	size_t i;
-	double *data;
 	double mean;
 	double vsum;
 	double ssum;
 	double ksum;
 
-	data = calloc(NORMAL_TEST_COUNT, sizeof(*data));
-
-	for (i = 0; i < NORMAL_TEST_COUNT/2; ++i) {
-		get_normals(&data[2*i], &data[2*i+1]);
-	}
-
 	mean = 0.0;
 	for (i = 0; i < NORMAL_TEST_COUNT; ++i) {
 		mean = mean + data[i];
@@ -49,11 +43,30 @@ void check_normals(void) {
 	ssum = ssum / NORMAL_TEST_COUNT;
 	ksum = ksum / NORMAL_TEST_COUNT;
 
-	printf("check_normals:\n");
+	printf("%s:\n", name);
 	printf("  mean: %f\n", mean);
 	printf("  variance: %f\n", vsum);
 	printf("  skewness: %f\n", ssum / pow(vsum, 3./2));
 	printf("  excess kurtosis: %f\n", ksum / pow(vsum, 2) - 3);
+}
+
+/**
+ * Check both the scalar and bulk normal generators
+ */
+void check_normals(void) {
+	size_t i;
+	double *data;
+
+	data = calloc(NORMAL_TEST_COUNT, sizeof(*data));
+	ASSERT(data);
+
+	for (i = 0; i < NORMAL_TEST_COUNT/2; ++i) {
+		get_normals(&data[2*i], &data[2*i+1]);
+	}
+	print_moments("check_normals", data);
+
+	get_normals_bulk(data, NORMAL_TEST_COUNT);
+	print_moments("check_normals (bulk)", data);
 
 	free(data);
 }
@@ -64,7 +77,7 @@ void check_normals(void) {
 void measure_covariance(int id, struct game_params_t *params) {
 	size_t i, j, k;
 	size_t n = params->rng_params.n;
-	uint32_t *attrs;
+	uint8_t *attrs;
 	double *vec;
 	double *mean;
 	double *Q;
@@ -81,10 +94,7 @@ void measure_covariance(int id, struct game_params_t *params) {
 	Q = calloc(n*n, sizeof(*Q));
 	ASSERT(Q);
 
-	for (i = 0; i < ATTR_TEST_COUNT; ++i) {
-		attrs[i] = generate_attributes(params->rng_params.n,
-			params->rng_params.t, params->rng_params.a);
-	}
+	generate_attributes_bulk(params, attrs, ATTR_TEST_COUNT);
 
 	// E[x] for each attribute in mean
 	for (i = 0; i < ATTR_TEST_COUNT; ++i) {
@@ -161,9 +171,52 @@ void measure_covariance(int id, struct game_params_t *params) {
 		printf("\n");
 	}
 
+	printf("  E[correlation matrix]:\n");
+	for (j = 0; j < n; ++j) {
+		printf("   ");
+		for (k = 0; k < n; ++k) {
+			printf(" % 08.6f", params->dist_params.corr[n*j + k]);
+		}
+		printf("\n");
+	}
+
 	free(attrs);
 }
 
+/**
+ * Compare the precomputed joint distribution for a set of game parameters against
+ * the frequencies from both the alias sampler and the reference generator
+ */
+void check_joint(int id, struct game_params_t *params) {
+	size_t i;
+	size_t n = params->rng_params.n;
+	double *alias_freq;
+	double *gen_freq;
+
+	alias_freq = calloc(BIT(n), sizeof(*alias_freq));
+	ASSERT(alias_freq);
+
+	gen_freq = calloc(BIT(n), sizeof(*gen_freq));
+	ASSERT(gen_freq);
+
+	for (i = 0; i < ATTR_TEST_COUNT; ++i) {
+		alias_freq[generate_person(params)] += 1;
+		gen_freq[generate_attributes(params->rng_params.n, params->rng_params.t,
+			params->rng_params.a)] += 1;
+	}
+
+	printf("\n  joint distribution (game %d):\n", id);
+	printf("    attrs  expected     alias        generator\n");
+	for (i = 0; i < BIT(n); ++i) {
+		printf("    %5zu  % 08.6f  % 08.6f  % 08.6f\n", i,
+			params->dist_params.joint[i], alias_freq[i] / ATTR_TEST_COUNT,
+			gen_freq[i] / ATTR_TEST_COUNT);
+	}
+
+	free(alias_freq);
+	free(gen_freq);
+}
+
 int main(int argc, char **argv) {
 	error_t *ret;
 
@@ -177,6 +230,7 @@ int main(int argc, char **argv) {
 	for (size_t i = 0; i < get_number_of_games(); ++i) {
 		printf("\n----\n\n");
 		measure_covariance(i, get_game_params(i));
+		check_joint(i, get_game_params(i));
 	}
 
 	return 0;
@@ -0,0 +1,341 @@
+#include <math.h>
+#include <stdbool.h>
+
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "attrs.h"
+#include "dist.h"
+
+// Simpson intervals used to integrate the bivariate normal, must be even
+#define BVN_INTERVALS 512
+
+// Limits on the quadrature used for the joint table: at most this many nodes per
+// side of each threshold, and at most this many leaf evaluations in total
+#define JOINT_MAX_NODES 24
+#define JOINT_EVAL_BUDGET (1 << 24)
+
+// Pivots smaller than this mean the attribute is fixed by the earlier ones
+#define JOINT_EPSILON 1e-12
+
+/**
+ * Standard normal distribution function
+ */
+double normal_cdf(double x) {
+	return 0.5 * erfc(-x / M_SQRT2);
+}
+
+/**
+ * Inverse of normal_cdf, using Acklam's rational approximation followed by one
+ * Halley step against erfc, which is good to about machine precision
+ */
+double normal_quantile(double p) {
+	static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+		-2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01,
+		2.506628277459239e+00};
+	static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+		-1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01};
+	static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+		-2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00,
+		2.938163982698783e+00};
+	static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+		2.445134137142996e+00, 3.754408661907416e+00};
+	const double plow = 0.02425;
+	double q, r, x, e, u;
+
+	if (p <= 0)
+		return -INFINITY;
+	if (p >= 1)
+		return INFINITY;
+
+	if (p < plow) {
+		q = sqrt(-2*log(p));
+		x = (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+			((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+	}
+	else if (p <= 1 - plow) {
+		q = p - 0.5;
+		r = q*q;
+		x = (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q /
+			(((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+	}
+	else {
+		q = sqrt(-2*log(1 - p));
+		x = -(((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+			((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+	}
+
+	e = normal_cdf(x) - p;
+	u = e * sqrt(2*M_PI) * exp(x*x / 2);
+	return x - u / (1 + x*u/2);
+}
+
+static double bvn_integrand(double h, double k, double theta) {
+	double s = sin(theta);
+	double c = cos(theta);
+
+	return exp(-(h*h + k*k - 2*h*k*s) / (2*c*c));
+}
+
+/**
+ * Upper orthant probability Pr(X > h, Y > k) for standard normals X and Y with
+ * correlation rho. This uses Sheppard's form,
+ *  Pr = F(-h)F(-k) + 1/2pi int_0^asin(rho) exp(-(h^2 + k^2 - 2hk sin t) / 2cos^2 t) dt
+ * which has a smooth integrand over the whole range, so composite Simpson with a
+ * few hundred intervals is already accurate to well beyond what we display
+ */
+double bvn_upper(double h, double k, double rho) {
+	double end, step, sum;
+	size_t i;
+
+	// Degenerate cases where the integrand endpoint has cos(t) = 0
+	if (rho >= 1.0)
+		return normal_cdf(-fmax(h, k));
+	if (rho <= -1.0)
+		return fmax(0.0, normal_cdf(-k) - normal_cdf(h));
+
+	end = asin(rho);
+	step = end / BVN_INTERVALS;
+	sum = bvn_integrand(h, k, 0) + bvn_integrand(h, k, end);
+
+	for (i = 1; i < BVN_INTERVALS; ++i) {
+		sum += ((i & 1) ? 4 : 2) * bvn_integrand(h, k, i*step);
+	}
+
+	return normal_cdf(-h)*normal_cdf(-k) + sum * step / (3 * 2 * M_PI);
+}
+
+/**
+ * Gauss-Legendre nodes and weights for q points mapped onto [0, 1], found by
+ * newton iteration on the legendre polynomial
+ */
+static void gauss_legendre(size_t q, double *x, double *w) {
+	for (size_t i = 0; i < (q + 1) / 2; ++i) {
+		double z = cos(M_PI * (i + 0.75) / (q + 0.5));
+		double z1, pp;
+
+		do {
+			double p1 = 1.0;
+			double p2 = 0.0;
+
+			for (size_t j = 0; j < q; ++j) {
+				double p3 = p2;
+				p2 = p1;
+				p1 = ((2.0*j + 1.0)*z*p2 - j*p3) / (j + 1);
+			}
+
+			pp = q * (z*p1 - p2) / (z*z - 1.0);
+			z1 = z;
+			z = z1 - p1 / pp;
+		} while (fabs(z - z1) > 1e-15);
+
+		x[i] = 0.5 * (1 - z);
+		x[q-1-i] = 0.5 * (1 + z);
+		w[i] = 1.0 / ((1 - z*z) * pp*pp);
+		w[q-1-i] = w[i];
+	}
+}
+
+struct joint_state {
+	size_t n;
+	size_t q;
+	const double *t;
+	double L[MAX_ATTRS*MAX_ATTRS];
+	double z[MAX_ATTRS];
+	double x[JOINT_MAX_NODES];
+	double w[JOINT_MAX_NODES];
+	double *out;
+};
+
+/**
+ * Integrate out level k given the values already chosen for z_0..z_k-1. With the
+ * cholesky factor, Y_k = m + L_kk z_k, so the attribute is a threshold on z_k alone.
+ * Each side of the threshold is integrated in probability space (z = F^-1(u)), which
+ * leaves a smooth integrand for the quadrature, and the last level is exact.
+ */
+static void joint_level(struct joint_state *js, size_t k, uint32_t bits, double weight) {
+	size_t n = js->n;
+	double m = 0;
+	double c, lo, hi;
+
+	for (size_t j = 0; j < k; ++j) {
+		m += js->L[n*k + j] * js->z[j];
+	}
+
+	if (js->L[n*k + k] < JOINT_EPSILON) {
+		if (m > js->t[k])
+			bits |= BIT(k);
+
+		if (k == n-1) {
+			js->out[bits] += weight;
+		}
+		else {
+			js->z[k] = 0;
+			joint_level(js, k+1, bits, weight);
+		}
+		return;
+	}
+
+	c = (js->t[k] - m) / js->L[n*k + k];
+	lo = normal_cdf(c);
+	hi = normal_cdf(-c);
+
+	if (k == n-1) {
+		js->out[bits] += weight * lo;
+		js->out[bits | BIT(k)] += weight * hi;
+		return;
+	}
+
+	for (size_t i = 0; i < js->q; ++i) {
+		js->z[k] = normal_quantile(lo * js->x[i]);
+		joint_level(js, k+1, bits, weight * lo * js->w[i]);
+
+		js->z[k] = -normal_quantile(hi * js->x[i]);
+		joint_level(js, k+1, bits | BIT(k), weight * hi * js->w[i]);
+	}
+}
+
+/**
+ * Compute the probability of each of the 2^n attribute combinations produced by
+ * generate_attributes() with these parameters. The covariance AA^T is factored so
+ * that the thresholds can be applied one dimension at a time, then each dimension
+ * is integrated with as many quadrature nodes as the evaluation budget allows.
+ */
+error_t *joint_table(size_t n, const double *t, const double *a, double *out) {
+	struct joint_state js = {0};
+	double total = 0;
+	size_t evals;
+
+	if (n == 0 || n > MAX_ATTRS)
+		return E_MSG("invalid number of attributes for joint table");
+
+	js.n = n;
+	js.t = t;
+	js.out = out;
+
+	// Cholesky factor L of the covariance AA^T, allowing for semidefinite input
+	for (size_t i = 0; i < n; ++i) {
+		for (size_t j = 0; j <= i; ++j) {
+			double sum = 0;
+
+			for (size_t k = 0; k < n; ++k) {
+				sum += a[n*i + k] * a[n*j + k];
+			}
+
+			for (size_t k = 0; k < j; ++k) {
+				sum -= js.L[n*i + k] * js.L[n*j + k];
+			}
+
+			if (i == j)
+				js.L[n*i + i] = sum > JOINT_EPSILON ? sqrt(sum) : 0;
+			else if (js.L[n*j + j] > 0)
+				js.L[n*i + j] = sum / js.L[n*j + j];
+		}
+	}
+
+	// Largest node count such that (2q)^(n-1) stays within the budget
+	js.q = JOINT_MAX_NODES;
+	do {
+		evals = 1;
+		for (size_t i = 1; i < n; ++i) {
+			evals *= 2 * js.q;
+		}
+
+		if (evals <= JOINT_EVAL_BUDGET)
+			break;
+		js.q -= 1;
+	} while (js.q > 1);
+
+	// The integrands in probability space have steep ends from F^-1, so the nodes
+	// are pulled towards both ends with u = 3x^2 - 2x^3
+	gauss_legendre(js.q, js.x, js.w);
+	for (size_t i = 0; i < js.q; ++i) {
+		double x = js.x[i];
+		js.x[i] = x*x*(3 - 2*x);
+		js.w[i] = js.w[i] * 6*x*(1 - x);
+	}
+
+	for (size_t i = 0; i < BIT(n); ++i) {
+		out[i] = 0;
+	}
+
+	joint_level(&js, 0, 0, 1.0);
+
+	// Quadrature error shows up as a small deviation in the total, remove it
+	for (size_t i = 0; i < BIT(n); ++i) {
+		total += out[i];
+	}
+
+	if (fabs(total - 1.0) > 1e-6)
+		return E_MSG("joint table does not sum to one");
+
+	for (size_t i = 0; i < BIT(n); ++i) {
+		out[i] = out[i] / total;
+	}
+
+	return OK;
+}
+
+/**
+ * Walker's alias tables for sampling from p with one uniform draw, built with
+ * Vose's method. Column i is kept when a 32 bit coin is below prob[i] and is
+ * otherwise replaced with alias[i].
+ */
+void build_alias(size_t size, const double *p, uint32_t *prob, uint8_t *alias) {
+	double scaled[size];
+	size_t small[size];
+	size_t large[size];
+	size_t ns = 0;
+	size_t nl = 0;
+
+	for (size_t i = 0; i < size; ++i) {
+		scaled[i] = p[i] * size;
+		alias[i] = (uint8_t) i;
+
+		if (scaled[i] < 1.0)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+
+	while (ns > 0 && nl > 0) {
+		size_t s = small[--ns];
+		size_t l = large[--nl];
+
+		prob[s] = (uint32_t) (scaled[s] * 0x1p32);
+		alias[s] = (uint8_t) l;
+
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		if (scaled[l] < 1.0)
+			small[ns++] = l;
+		else
+			large[nl++] = l;
+	}
+
+	// Anything left over is 1 up to rounding error and always keeps its column
+	while (nl > 0)
+		prob[large[--nl]] = UINT32_MAX;
+	while (ns > 0)
+		prob[small[--ns]] = UINT32_MAX;
+}
+
+DEFINE_BASIC_TEST(bvn_upper_values, {
+	// Independent case factors, and Pr(X > 0, Y > 0) = 1/4 + asin(rho)/2pi
+	TEST_EQUALS(fabs(bvn_upper(0.3, -0.2, 0) - normal_cdf(-0.3)*normal_cdf(0.2)) < 1e-12,
+		true);
+	TEST_EQUALS(fabs(bvn_upper(0, 0, 0.5) - (0.25 + asin(0.5)/(2*M_PI))) < 1e-12, true);
+	TEST_EQUALS(fabs(bvn_upper(0, 0, -0.9) - (0.25 + asin(-0.9)/(2*M_PI))) < 1e-12, true);
+});
+
+DEFINE_BASIC_TEST(joint_table_values, {
+	double out[4];
+	double rho = -1 / M_SQRT2;
+
+	// Two attributes from game type 0, the table must agree with the closed form
+	// marginals and the bivariate orthant probability
+	TEST_EQUALS(joint_table(2, (double[]) {0.5, 0.2},
+		(double[]) {1.0, 0.0, -1.0, 1.0}, out), OK);
+	TEST_EQUALS(fabs(out[3] - bvn_upper(0.5, 0.2 / M_SQRT2, rho)) < 1e-9, true);
+	TEST_EQUALS(fabs(out[1] + out[3] - normal_cdf(-0.5)) < 1e-9, true);
+	TEST_EQUALS(fabs(out[2] + out[3] - normal_cdf(-0.2 / M_SQRT2)) < 1e-9, true);
+});
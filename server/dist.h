@@ -0,0 +1,16 @@
+#ifndef _DIST_H_
+#define _DIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libgjm/errors.h>
+
+double normal_cdf(double x);
+double normal_quantile(double p);
+double bvn_upper(double h, double k, double rho);
+
+error_t *joint_table(size_t n, const double *t, const double *a, double *out);
+void build_alias(size_t size, const double *p, uint32_t *prob, uint8_t *alias);
+
+#endif
@@ -1,19 +1,18 @@
+#include <ctype.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdarg.h>
 
+#include "async.h"
+#include "cache.h"
+#include "dist.h"
 #include "goal.h"
 #include "game.h"
+#include "history.h"
+#include "recent.h"
+#include "rng.h"
 #include "valkey.h"
 
-// Number of warm up loops to use with WELL before running games off it
-#define RNG_INIT_LOOPS 1000
-
-// Number of symbols to generate in order to measure attribute statistics
-#define ATTR_STAT_COUNT 10000000
-
-static pthread_spinlock_t rng_lock;
-static struct well_state_t rng = {0};
-
 static struct game_params_t game_params[] = {
 	{
 		.rng_params = {
@@ -126,15 +125,76 @@ static struct game_params_t game_params[] = {
 };
 
 static size_t n_games = ARRAY_SIZE(game_params);
+static bool early_end;
+
+/**
+ * Record moves for a game in one atomic step, so that concurrent requests for the
+ * same game cannot interleave and a repeated verdict cannot be applied twice.
+ * Histories are written packed, see history.c, and a game still in the original
+ * format is converted on its next move by writing its whole history.
+ *  KEYS[1] game hash, KEYS[2] original history, KEYS[3] summaries hash
+ *  KEYS[4] leaderboard for the game type, KEYS[5] best score per user for the type
+ *  KEYS[6] packed history
+ *  ARGV[1] history length the moves were decided against
+ *  ARGV[2] packed moves to write at byte ARGV[8] of the packed history
+ *  ARGV[3] next patron, or empty if the game is over
+ *  ARGV[4] game id and ARGV[5] its new summary
+ *  ARGV[6] score if these moves won the game, otherwise empty, ARGV[7] user id.
+ *  Games on a seed the client chose are never ranked, whatever ARGV[6] says.
+ *  ARGV[9..] aggregate field and value pairs to store, including the history version
+ */
+#define MOVES_SCRIPT \
+	"local len\n" \
+	"if redis.call('HEXISTS', KEYS[1], 'history') == 1 then\n" \
+	"	len = tonumber(redis.call('HGET', KEYS[1], 'count'))\n" \
+	"else\n" \
+	"	len = redis.call('STRLEN', KEYS[2])\n" \
+	"end\n" \
+	"if len ~= tonumber(ARGV[1]) then\n" \
+	"	return redis.error_reply('CONFLICT wrong person')\n" \
+	"end\n" \
+	"if redis.call('HEXISTS', KEYS[1], 'next') == 0 then\n" \
+	"	return redis.error_reply('CONFLICT no patron available')\n" \
+	"end\n" \
+	"redis.call('SETRANGE', KEYS[6], ARGV[8], ARGV[2])\n" \
+	"redis.call('DEL', KEYS[2])\n" \
+	"if ARGV[3] == '' then\n" \
+	"	redis.call('HDEL', KEYS[1], 'next')\n" \
+	"else\n" \
+	"	redis.call('HSET', KEYS[1], 'next', ARGV[3])\n" \
+	"end\n" \
+	"redis.call('HSET', KEYS[1], unpack(ARGV, 9))\n" \
+	"redis.call('HSET', KEYS[3], ARGV[4], ARGV[5])\n" \
+	"if ARGV[6] ~= '' and redis.call('HGET', KEYS[1], 'seeded') ~= '1' then\n" \
+	"	redis.call('ZADD', KEYS[4], ARGV[6], ARGV[4])\n" \
+	"	redis.call('ZADD', KEYS[5], 'LT', ARGV[6], ARGV[7])\n" \
+	"end\n" \
+	"return redis.status_reply('OK')\n"
+
+// Keys, fixed arguments, then history, count, accepted, terminated and each
+// attribute as field and value
+#define MOVES_SCRIPT_KEYS 6
+#define MOVES_SCRIPT_ARGS (MOVES_SCRIPT_KEYS + 8 + 2*(4 + MAX_ATTRS))
+
+static struct valkey_script moves_script = {
+	.source = MOVES_SCRIPT,
+};
 
 /**
- * @todo this needs th closed form expression for the correlation
+ * Each attribute is the event Y_i > t_i where Y = Ax for a vector x of independent
+ * standard normals, so Y is jointly normal with covariance AA^T. Both the marginals
+ * and the pairwise joint probabilities follow from the normal and bivariate normal
+ * distribution functions of the standardized thresholds, and from those we get the
+ * covariance and correlation of the bernoulli attributes directly.
  */
 static void assign_dist_params(struct game_params_t *params) {
 	size_t i, j, k;
 	size_t n = params->rng_params.n;
-	double *vec, *mean, *Q;
-	uint32_t *attrs;
+	double *a = params->rng_params.a;
+	double *t = params->rng_params.t;
+	double *p = params->dist_params.marginals;
+	double sigma[n];
+	double h[n];
 
 	/*
 	 * The marginal probability that an attirbute is set is:
@@ -147,135 +207,115 @@ static void assign_dist_params(struct game_params_t *params) {
 	for (i = 0; i < n; ++i) {
 		double sum = 0;
 		for (j = 0; j < n; ++j) {
-			sum += pow(params->rng_params.a[i*n + j], 2);
+			sum += pow(a[i*n + j], 2);
 		}
 
-		params->dist_params.marginals[i] =
-			0.5*(1 - erf(params->rng_params.t[i] / sqrt(2*sum)));
+		sigma[i] = sqrt(sum);
+		h[i] = t[i] / sigma[i];
+		p[i] = 0.5*(1 - erf(t[i] / sqrt(2*sum)));
 	}
 
 	/*
-	 * The correlation has not been computed in closed form yet so
-	 * we generate a large number of instances of the attributes and
-	 * then compute their statistics. Hopefully this will change in
-	 * the near future
+	 * For a pair of attributes the correlation of Y_i and Y_j is
+	 * rho = sum_k(a_ik * a_jk) / (sigma_i * sigma_j), and the probability both are
+	 * set is the upper orthant probability at the standardized thresholds. Then
+	 * cov(X_i, X_j) = p_ij - p_i*p_j and var(X_i) = p_i*(1 - p_i)
 	 */
-	attrs = calloc(ATTR_STAT_COUNT, sizeof(*attrs));
-	ASSERT(attrs);
-
-	mean = calloc(n, sizeof(*mean));
-	ASSERT(mean);
-
-	vec = calloc(n, sizeof(*vec));
-	ASSERT(vec);
-
-	Q = calloc(n*n, sizeof(*Q));
-	ASSERT(Q);
-
-	for (i = 0; i < ATTR_STAT_COUNT; ++i) {
-		attrs[i] = generate_attributes(params->rng_params.n,
-			params->rng_params.t, params->rng_params.a);
-	}
-
-	// E[x] for each attribute in mean
-	for (i = 0; i < ATTR_STAT_COUNT; ++i) {
-		for (j = 0; j < n; ++j) {
-			if (is_flag_set(attrs[i], BIT(j)))
-				mean[j] += 1;
-		}
-	}
 	for (i = 0; i < n; ++i) {
-		mean[i] = mean[i] / ATTR_STAT_COUNT;
-	}
+		params->dist_params.corr[n*i + i] = 1.0;
 
-	// Covariance matrix estimated using the sample covariance
-	// 1/(n-1) sum (X-E[X])(X-E[X])^T
-	for (i = 0; i < ATTR_STAT_COUNT; ++i) {
-		for (j = 0; j < n; ++j) {
-			vec[j] = -mean[j];
-			if (is_flag_set(attrs[i], BIT(j)))
-				vec[j] += 1.0;
-		}
+		for (j = i+1; j < n; ++j) {
+			double rho = 0, pij, corr;
 
-		for (j = 0; j < n; ++j) {
 			for (k = 0; k < n; ++k) {
-				Q[n*j + k] += vec[j] * vec[k];
+				rho += a[i*n + k] * a[j*n + k];
 			}
-		}
-	}
-	for (j = 0; j < n; ++j) {
-		for (k = 0; k < n; ++k) {
-			Q[n*j + k] = Q[n*j + k] / (ATTR_STAT_COUNT-1);
-		}
-	}
+			rho = rho / (sigma[i] * sigma[j]);
 
-	// With fully populated covariance, calculate correlation matrix
-	for (j = 0; j < n; ++j) {
-		for (k = 0; k < n; ++k) {
-			params->dist_params.corr[n*j+k] = Q[n*j+k]/sqrt(Q[n*j+j]*Q[n*k+k]);
+			pij = bvn_upper(h[i], h[j], rho);
+			corr = (pij - p[i]*p[j]) / sqrt(p[i]*(1 - p[i]) * p[j]*(1 - p[j]));
+
+			params->dist_params.corr[n*i + j] = corr;
+			params->dist_params.corr[n*j + i] = corr;
 		}
 	}
-
-	free(mean);
-	free(vec);
-	free(Q);
-	free(attrs);
 }
 
 /**
- * Passable state initialization for WELL. It is claimed that it achieves a good
- * distribution from an arbitrary state initialization within a reasonably small
- * number of samples, so we prepopulate with garbage from rand and iterate some
- * time to guess that we're in the well behaved region
- *
- * Unlocked call because this should be done at init time before other threads
- * are activated
+ * Prepare the rng and every parameter set, without touching valkey, for tools
+ * that only generate patrons
  */
-static void init_rng(void) {
-	size_t i;
+error_t *init_game_params(void) {
+	error_t *ret;
 
-	memset(&rng, 0, sizeof(rng));
-	srand(time(NULL));
+	DEBUG("initializing game\n");
+	ret = init_rng();
+	if (NOT_OK(ret))
+		return ret;
 
-	for (i = 0; i < 32; ++i) {
-		rng.state[i] = rand();
-	}
+	for (size_t i = 0; i < n_games; ++i) {
+		struct game_params_t *params = &game_params[i];
+		size_t n = params->rng_params.n;
+
+		assign_dist_params(params);
 
-	for (i = 0; i < RNG_INIT_LOOPS; ++i) {
-		UNUSED(well_1024a(&rng));
+		ret = joint_table(n, params->rng_params.t, params->rng_params.a,
+			params->dist_params.joint);
+		if (NOT_OK(ret))
+			return ret;
+
+		build_alias(BIT(n), params->dist_params.joint, params->dist_params.alias_prob,
+			params->dist_params.alias);
+
+		if (params->n_goals > MAX_GOALS)
+			return E_MSG("too many goals in parameter set");
+
+		for (size_t g = 0; g < params->n_goals; ++g) {
+			ret = compile_goal(&params->goals[g], n);
+			if (NOT_OK(ret)) {
+				ERROR("goal %zu of parameter set %zu is invalid\n", g, i);
+				return ret;
+			}
+		}
+
+		DEBUG("parameter set %zu ready\n", i);
 	}
 
-	pthread_spin_init(&rng_lock, 0);
+	return OK;
 }
 
 error_t *init_game(void) {
-	DEBUG("initializing game\n");
-	init_rng();
+	error_t *ret;
 
-	for (size_t i = 0; i < n_games; ++i) {
-		assign_dist_params(&game_params[i]);
-		DEBUG("parameter set %zu ready\n", i);
-	}
+	ret = init_game_params();
+	if (NOT_OK(ret))
+		return ret;
+
+	init_game_cache();
+	ret = init_valkey();
+	if (NOT_OK(ret))
+		return ret;
+
+	return valkey_load_script(&moves_script);
+}
 
-	return init_valkey();
+/**
+ * Prepare for the asynchronous game operations, before the event loop starts
+ */
+void init_game_async(void) {
+	async_register_script(&moves_script);
 }
 
 /**
- * Using the box-muller transform obtain two normals at once, with 4 calls to well
+ * Using the box-muller transform obtain two normals at once, from one block of the
+ * calling thread's stream
  */
 void get_normals(double *a, double *b) {
-	size_t i;
-	uint32_t vals[4];
+	uint32_t vals[RNG_BLOCK_WORDS];
 	uint64_t u0i, u1i;
 	double u0, u1;
 
-	pthread_spin_lock(&rng_lock);
-
-	for (i = 0; i < 4; ++i) {
-		vals[i] = well_1024a(&rng);
-	}
-
-	pthread_spin_unlock(&rng_lock);
+	rng_next(thread_rng(), vals);
 
 	u0i = (((uint64_t) vals[0]) << 32) | vals[1];
 	u1i = (((uint64_t) vals[2]) << 32) | vals[3];
@@ -332,6 +372,51 @@ uint32_t generate_attributes(size_t n, double *t, double *a) {
 	return res;
 }
 
+static uint32_t sample_person(struct game_params_t *params,
+	const uint32_t vals[RNG_BLOCK_WORDS])
+{
+	uint32_t col = (uint32_t) (((uint64_t) vals[0] << params->rng_params.n) >> 32);
+
+	if (vals[1] < params->dist_params.alias_prob[col])
+		return col;
+	return params->dist_params.alias[col];
+}
+
+/**
+ * Sample a person from the precomputed joint distribution of a parameter set. This
+ * has the same distribution as generate_attributes() with the same parameters but
+ * only needs one random block and a table lookup: the top 32 bits pick a column and
+ * the bottom 32 bits decide between the column and its alias
+ */
+uint32_t generate_person(struct game_params_t *params) {
+	uint32_t vals[RNG_BLOCK_WORDS];
+
+	rng_next(thread_rng(), vals);
+	return sample_person(params, vals);
+}
+
+/**
+ * Patron i of the sequence for a seed, from the block at counter i under the seed
+ * as key, so any patron can be drawn again without the ones before it
+ */
+uint32_t generate_person_at(struct game_params_t *params, uint64_t seed, uint32_t i) {
+	uint32_t key[2] = { (uint32_t) seed, (uint32_t) (seed >> 32) };
+	uint32_t ctr[4] = { i, 0, 0, 0 };
+	uint32_t vals[RNG_BLOCK_WORDS];
+
+	rng_block(key, ctr, vals);
+	return sample_person(params, vals);
+}
+
+/**
+ * The patron after the history, from the game's seed if it has one
+ */
+static uint8_t next_person(struct game_t *game) {
+	if (game->history == HISTORY_SEEDED)
+		return (uint8_t) generate_person_at(game->params, game->seed, game->count);
+	return (uint8_t) generate_person(game->params);
+}
+
 bool valid_game_type(size_t type) {
 	return type < n_games;
 }
@@ -347,237 +432,661 @@ size_t get_number_of_games(void) {
 	return n_games;
 }
 
+/**
+ * End games as soon as their goals are settled rather than at the limits, only
+ * before the server starts
+ */
+void game_set_early_end(bool enable) {
+	early_end = enable;
+}
+
 bool game_is_finished(struct game_t *game) {
-	return (game->accepted >= ACCEPTED_LIMIT) || (game->count >= LOSS_LIMIT);
+	return game->terminated || (game->accepted >= ACCEPTED_LIMIT)
+		|| (game->count >= LOSS_LIMIT);
 }
 
-void game_update(struct game_t *game) {
-	game->accepted = 0;
-	for (size_t i = 0; i < MAX_ATTRS; ++i)
-		game->attr_n[i] = 0;
+/**
+ * Make sure the history has room for at least size people, growing it by doubling
+ */
+static error_t *game_reserve(struct game_t *game, uint32_t size) {
+	uint32_t new_size = game->seen_size ? game->seen_size : GAME_SEEN_INITIAL;
+	uint8_t *seen;
 
-	for (uint32_t i = 0; i < game->count; ++i) {
-		if (is_flag_set(game->seen[i], BIT_ATTR_ACCEPT))
-			game->accepted += 1;
+	if (size <= game->seen_size)
+		return OK;
 
-		for (uint8_t attr = 0; attr < MAX_ATTRS; ++attr) {
-			if (is_flag_set(game->seen[i], BIT(attr))
-				&& is_flag_set(game->seen[i], BIT_ATTR_ACCEPT))
-			{
-				game->attr_n[attr] += 1;
-			}
+	while (new_size < size)
+		new_size = 2 * new_size;
+
+	seen = realloc(game->seen, new_size);
+	if (!seen)
+		return E_NOMEM;
+
+	game->seen = seen;
+	game->seen_size = new_size;
+	return OK;
+}
+
+/**
+ * Fold one more reviewed person into the running totals, the only place that the
+ * aggregates change during play. The history must already have room for them.
+ */
+static void game_add_person(struct game_t *game, uint8_t attr) {
+	game->seen[game->count] = attr;
+	game->count += 1;
+
+	if (is_flag_set(attr, BIT_ATTR_ACCEPT)) {
+		game->accepted += 1;
+
+		for (uint8_t i = 0; i < MAX_ATTRS; ++i) {
+			if (is_flag_set(attr, BIT(i)))
+				game->attr_n[i] += 1;
 		}
+
+		update_goal_margins(game, attr);
 	}
 
 	if (game_is_finished(game))
 		game->goals_satisfied = check_goals(game);
 }
 
-error_t *create_next_person(struct game_t *game) {
-	uint32_t attr;
-	valkeyReply *reply;
-	error_t *ret = OK;
-	struct valkey_t *vk = get_valkey();
+/**
+ * Rebuild the aggregates from the full history, only needed for games stored
+ * before the aggregates were saved alongside them
+ */
+static void game_recount(struct game_t *game) {
+	uint32_t count = game->count;
 
- 	attr = generate_attributes(game->params->rng_params.n, game->params->rng_params.t,
-		game->params->rng_params.a);
-	game->next = (uint8_t) attr;
+	game->count = 0;
+	game->accepted = 0;
+	for (size_t i = 0; i < MAX_ATTRS; ++i)
+		game->attr_n[i] = 0;
+	reset_goal_margins(game);
 
-	reply = valkeyCommand(vk->ctx, "HMSET %s next %d", game->name, attr);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		ret = E_VALKEY(vk->ctx, reply);
+	for (uint32_t i = 0; i < count; ++i)
+		game_add_person(game, game->seen[i]);
+}
 
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return ret;
+/**
+ * Where a game stands, running until it is finished and then won or lost on its goals
+ */
+enum game_status game_status(struct game_t *game) {
+	if (!game_is_finished(game))
+		return GAME_RUNNING;
+	return game->goals_satisfied ? GAME_COMPLETED : GAME_FAILED;
 }
 
-error_t *new_game(int type, struct user_t *user, struct game_t *dest) {
-	uuid_t uuid;
-	int len;
-	struct valkey_t *vk;
-	valkeyReply *reply;
-	error_t *ret;
-	char localbuf[128];
+void summarize_game(struct game_t *game, struct game_summary *out) {
+	out->id = game->id;
+	out->count = game->count;
+	out->accepted = game->accepted;
+	out->type = game->type;
+	out->status = game_status(game);
+	out->found = true;
+}
 
-	memset(dest, 0, sizeof(*dest));
+/**
+ * Games are ranked by how many patrons they turned away, fewest first
+ */
+uint32_t game_score(struct game_t *game) {
+	return game->count - game->accepted;
+}
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "INCR next_game");
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+/**
+ * Name of the sorted set ranking won games of a type by score, or the one holding
+ * each user's best score for the type
+ */
+void leaderboard_key(char *buf, size_t len, int type, bool users) {
+	snprintf(buf, len, "%s-%d%s", VALKEY_LEADERBOARD, type, users ? "-users" : "");
+}
 
-	uuid_generate(uuid);
-	uuid_unparse(uuid, dest->name);
-	dest->id = reply->integer;
-	dest->userid = user->id;
-	dest->type = type;
-	dest->params = get_game_params(type);
+/**
+ * The value kept for a game in the summaries hash
+ */
+static void format_summary(char buf[GAME_SUMMARY_LEN], struct game_t *game) {
+	snprintf(buf, GAME_SUMMARY_LEN, "%u %u %d %d", game->count, game->accepted,
+		game->type, game_status(game));
+}
+
+/**
+ * Arguments for the moves script, along with the buffers that they point into
+ */
+struct moves_args {
+	int argc;
+	const char *argv[MOVES_SCRIPT_ARGS];
+	size_t argvlen[MOVES_SCRIPT_ARGS];
+	char keybuf[UUID_NAME_LEN+2];
+	char packed_key[UUID_NAME_LEN+2];
+	uint8_t packed[HISTORY_BYTES(LOSS_LIMIT, HISTORY_WIDTH(MAX_ATTRS))];
+	size_t packed_len;
+	char offset[16];
+	char version[8];
+	char id[16];
+	char summary[GAME_SUMMARY_LEN];
+	char board[32];
+	char user_board[32];
+	char score[16];
+	char userid[16];
+	char vals[4 + MAX_ATTRS][16];
+	char keys[MAX_ATTRS][8];
+};
 
-	if (!dest->params) {
-		ret = E_MSG("invalid game type");
-		goto fail_reply;
+/**
+ * Attributes kept for each patron in a stored history of the given format
+ */
+static size_t stored_attrs(struct game_t *game, uint8_t history) {
+	return history == HISTORY_SEEDED ? 0 : game->params->rng_params.n;
+}
+
+/**
+ * Fill in the script arguments that write the moves from start onwards in the in
+ * memory history, along with the aggregates and pending patron they produced. The
+ * arguments point into the game so they must be used before it changes again.
+ */
+static void moves_args(struct moves_args *args, struct game_t *game, uint32_t start) {
+	uint8_t history = game->history ? game->history : HISTORY_PACKED;
+	size_t offset;
+	int argc = 0;
+
+	// A game still in the original format has its whole history written packed
+	args->packed_len = history_pack(args->packed, game->seen,
+		game->history ? start : 0, game->count, stored_attrs(game, history), &offset);
+
+	snprintf(args->keybuf, sizeof(args->keybuf), "%s-m", game->name);
+	snprintf(args->packed_key, sizeof(args->packed_key), "%s-h", game->name);
+	snprintf(args->offset, sizeof(args->offset), "%zu", offset);
+	snprintf(args->version, sizeof(args->version), "%d", history);
+	snprintf(args->vals[0], sizeof(args->vals[0]), "%u", start);
+	snprintf(args->vals[1], sizeof(args->vals[1]), "%u", game->next);
+	snprintf(args->vals[2], sizeof(args->vals[2]), "%u", game->count);
+	snprintf(args->vals[3], sizeof(args->vals[3]), "%u", game->accepted);
+	snprintf(args->id, sizeof(args->id), "%u", game->id);
+	format_summary(args->summary, game);
+	leaderboard_key(args->board, sizeof(args->board), game->type, false);
+	leaderboard_key(args->user_board, sizeof(args->user_board), game->type, true);
+	snprintf(args->userid, sizeof(args->userid), "%u", game->userid);
+
+	// Moves are only committed while a game is running, so a won game is scored
+	// exactly once
+	args->score[0] = '\0';
+	if (game_status(game) == GAME_COMPLETED && !game->seeded)
+		snprintf(args->score, sizeof(args->score), "%u", game_score(game));
+
+	args->argv[argc++] = game->name;
+	args->argv[argc++] = args->keybuf;
+	args->argv[argc++] = VALKEY_SUMMARIES;
+	args->argv[argc++] = args->board;
+	args->argv[argc++] = args->user_board;
+	args->argv[argc++] = args->packed_key;
+	args->argv[argc++] = args->vals[0];
+	args->argv[argc++] = (const char *) args->packed;
+	args->argv[argc++] = game->has_next ? args->vals[1] : "";
+	args->argv[argc++] = args->id;
+	args->argv[argc++] = args->summary;
+	args->argv[argc++] = args->score;
+	args->argv[argc++] = args->userid;
+	args->argv[argc++] = args->offset;
+	args->argv[argc++] = "history";
+	args->argv[argc++] = args->version;
+	args->argv[argc++] = "count";
+	args->argv[argc++] = args->vals[2];
+	args->argv[argc++] = "accepted";
+	args->argv[argc++] = args->vals[3];
+	args->argv[argc++] = "terminated";
+	args->argv[argc++] = game->terminated ? "1" : "0";
+
+	for (size_t i = 0; i < MAX_ATTRS; ++i) {
+		snprintf(args->keys[i], sizeof(args->keys[i]), "a%zu", i);
+		snprintf(args->vals[4 + i], sizeof(args->vals[4 + i]), "%u", game->attr_n[i]);
+		args->argv[argc++] = args->keys[i];
+		args->argv[argc++] = args->vals[4 + i];
 	}
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "HSET %s id %d userid %d type %d", dest->name,
-		dest->id, user->id, type);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+	for (int i = 0; i < argc; ++i)
+		args->argvlen[i] = strlen(args->argv[i]);
+	// The moves are binary and may contain zero bytes
+	args->argvlen[MOVES_SCRIPT_KEYS + 1] = args->packed_len;
+	args->argc = argc;
+}
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "HSET gameids %d %s", dest->id, dest->name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+/**
+ * Interpret the reply to the moves script. Fails with "wrong person" if valkey had
+ * moved on from where the moves started, for example because another request got
+ * there first.
+ */
+static error_t *moves_result(struct game_t *game, valkeyContext *ctx, valkeyReply *reply) {
+	if (!reply)
+		return E_VALKEY(ctx, reply);
 
-	snprintf(localbuf, sizeof(localbuf), "%s-games", user->name);
+	if (reply->type != VALKEY_REPLY_ERROR)
+		return OK;
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "LPUSH %s %d", localbuf, dest->id);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		DEBUG("orphaned game %s, owned by user %s\n", dest->name, user->name);
-		goto fail_valkey;
+	if (strncmp(reply->str, "CONFLICT ", 9) == 0) {
+		DEBUG("game %s: %s\n", game->name, reply->str + 9);
+		return E_MSG("wrong person");
 	}
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "LLEN %s", localbuf);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+	return E_VALKEY(ctx, reply);
+}
 
-	len = reply->integer;
-	if (len > VALKEY_USER_GAME_HISTORY) {
-		freeReplyObject(reply);
-		reply = valkeyCommand(vk->ctx, "RPOP %s", localbuf);
+/**
+ * Write moves to valkey in a single round trip
+ */
+static error_t *commit_moves(struct game_t *game, uint32_t start) {
+	struct moves_args args;
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	error_t *ret;
 
-		if (!reply || reply->type == VALKEY_REPLY_ERROR)
-			goto fail_valkey;
+	vk = get_valkey();
+	if (!vk)
+		return E_VALKEY_BUSY;
+
+	moves_args(&args, game, start);
+	reply = valkey_eval(vk, &moves_script, MOVES_SCRIPT_KEYS, args.argc, args.argv,
+		args.argvlen);
+	ret = moves_result(game, vk->ctx, reply);
+	if (ret == OK) {
+		if (!game->history)
+			game->history = HISTORY_PACKED;
+		recent_update(game);
 	}
 
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return create_next_person(dest);
-
-fail_valkey:
-	ret = E_VALKEY(vk->ctx, reply);
-fail_reply:
 	freeReplyObject(reply);
 	release_valkey(vk);
 	return ret;
 }
 
-bool find_user(uuid_t id, struct user_t *user) {
-	struct valkey_t *vk;
-	struct valkeyReply *reply;
+/**
+ * Start a game of the given type, ready to be given its id by fill_new_game()
+ */
+static error_t *prepare_new_game(int type, struct game_t *dest) {
+	memset(dest, 0, sizeof(*dest));
 
-	uuid_unparse_lower(id, user->name);
+	dest->params = get_game_params(type);
+	if (!dest->params)
+		return E_MSG("invalid game type");
+	reset_goal_margins(dest);
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "HMGET %s id name", user->name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto failure;
+	dest->type = type;
+	return OK;
+}
 
-	if (reply->elements != 2)
-		goto failure;
+static void fill_new_game(struct game_t *dest, struct user_t *user, const uint64_t *seed,
+	uint32_t id)
+{
+	uuid_t uuid;
 
-	if (reply->element[0]->type != VALKEY_REPLY_STRING)
-		goto failure;
+	uuid_generate(uuid);
+	uuid_unparse(uuid, dest->name);
+	dest->id = id;
+	dest->userid = user->id;
+	// A seed the client knows lets it see every patron coming, so those games are
+	// kept off the leaderboards, and the server's own seeds are never revealed
+	dest->history = HISTORY_SEEDED;
+	if (seed) {
+		dest->seed = *seed;
+		dest->seeded = true;
+	}
+	else {
+		dest->seed = rng_private_seed();
+	}
 
-	user->id = atoi(reply->element[0]->str);
-	memset(user->realname, 0, sizeof(user->realname));
-	ASSERT(reply->element[1]->len <= USER_NAME_LEN);
-	memcpy(user->realname, reply->element[1]->str, reply->element[1]->len);
+	dest->next = next_person(dest);
+	dest->has_next = true;
+}
 
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return true;
+/**
+ * Somewhere to send the commands that create a game, so that new_game() and
+ * new_game_async() always write the same keys
+ */
+typedef void (new_game_cmd_fn)(void *target, const char *fmt, ...);
 
-failure:
-	release_valkey(vk);
-	return false;
+static void new_game_commands(struct game_t *game, struct user_t *user,
+	new_game_cmd_fn *add, void *target)
+{
+	char localbuf[128];
+	char summary[GAME_SUMMARY_LEN];
+
+	snprintf(localbuf, sizeof(localbuf), "%s-games", user->name);
+	format_summary(summary, game);
+
+	add(target,
+		"HSET %s id %d userid %d type %d history %d seed %llu seeded %d count 0 "
+		"accepted 0 next %d", game->name, game->id, user->id, game->type,
+		HISTORY_SEEDED, (unsigned long long) game->seed, game->seeded, game->next);
+	add(target, "HSET gameids %d %s", game->id, game->name);
+	add(target, "HSET %s %d %s", VALKEY_SUMMARIES, game->id, summary);
+	add(target, "LPUSH %s %d", localbuf, game->id);
+	add(target, "LTRIM %s 0 %d", localbuf, VALKEY_USER_GAME_HISTORY - 1);
 }
 
-bool find_user_by_id(uint32_t id, struct user_t *user) {
-	uuid_t user_uuid;
+static void new_game_batch_cmd(void *target, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	valkey_batch_vadd(target, fmt, args);
+	va_end(args);
+}
+
+/**
+ * Create a game with its first patron already waiting. The id has to be allocated
+ * first, and then everything that depends on it is sent as one batch.
+ */
+error_t *new_game(int type, struct user_t *user, const uint64_t *seed,
+	struct game_t *dest)
+{
 	struct valkey_t *vk;
-	struct valkeyReply *reply;
+	struct valkey_batch batch;
+	valkeyReply *reply;
+	error_t *ret;
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "HGET userids %d", id);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto failure;
+	ret = prepare_new_game(type, dest);
+	if (NOT_OK(ret))
+		return ret;
 
-	if (reply->type != VALKEY_REPLY_STRING)
-		goto failure;
+	vk = get_valkey();
+	if (!vk)
+		return E_VALKEY_BUSY;
 
-	if (uuid_parse(reply->str, user_uuid) < 0)
-		goto failure;
+	reply = valkeyCommand(vk->ctx, "INCR next_game");
+	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
+		ret = E_VALKEY(vk->ctx, reply);
+		freeReplyObject(reply);
+		release_valkey(vk);
+		return ret;
+	}
 
+	fill_new_game(dest, user, seed, reply->integer);
 	freeReplyObject(reply);
-	release_valkey(vk);
-	return find_user(user_uuid, user);
 
-failure:
-	freeReplyObject(reply);
+	valkey_batch_init(&batch, vk);
+	new_game_commands(dest, user, new_game_batch_cmd, &batch);
+
+	ret = valkey_batch_run(&batch);
+	if (NOT_OK(ret))
+		DEBUG("failed to create game %s for user %s\n", dest->name, user->name);
+	else
+		recent_update(dest);
+
+	valkey_batch_free(&batch);
 	release_valkey(vk);
-	return false;
+	return ret;
 }
 
-bool find_user_by_name(const char *name, struct user_t *user) {
-	uuid_t user_uuid;
-	struct valkey_t *vk;
-	struct valkeyReply *reply;
+/**
+ * An asynchronous creation of a game, finished when every write has been answered
+ */
+struct async_create {
+	struct game_t *dest;
+	struct user_t user;
+	bool has_seed;
+	uint64_t seed;
+	game_done_fn *done;
+	void *priv;
+	size_t pending;
+	error_t *ret;
+};
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "HGET usernames %s", name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto failure;
+static void async_create_finish(struct async_create *ng) {
+	if (NOT_OK(ng->ret))
+		DEBUG("failed to create game %s for user %s\n", ng->dest->name, ng->user.name);
+	else
+		recent_update(ng->dest);
 
-	if (reply->type != VALKEY_REPLY_STRING)
-		goto failure;
+	ng->done(ng->priv, ng->ret);
+	free(ng);
+}
 
-	if (uuid_parse(reply->str, user_uuid) < 0)
-		goto failure;
+static void on_new_game_written(valkeyAsyncContext *c, void *r, void *priv) {
+	struct async_create *ng = priv;
+	valkeyContext *ctx = &c->c;
+	valkeyReply *reply = r;
 
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return find_user(user_uuid, user);
+	if (ng->ret == OK && (!reply || reply->type == VALKEY_REPLY_ERROR))
+		ng->ret = E_VALKEY(ctx, reply);
 
-failure:
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return false;
+	ng->pending -= 1;
+	if (ng->pending == 0)
+		async_create_finish(ng);
 }
 
-bool find_user_by_string(const char *str, struct user_t *user) {
-	uuid_t uuid;
-	int id;
-
-	if (uuid_parse(str, uuid) == 0)
-		return find_user(uuid, user);
+static void new_game_async_cmd(void *target, const char *fmt, ...) {
+	struct async_create *ng = target;
+	va_list args;
+	bool queued;
 
-	if (find_user_by_name(str, user))
-		return true;
+	va_start(args, fmt);
+	queued = async_vcommand(on_new_game_written, ng, fmt, args);
+	va_end(args);
 
-	id = atoi(str);
-	return find_user_by_id(id, user);
+	if (queued)
+		ng->pending += 1;
+	else if (ng->ret == OK)
+		ng->ret = E_MSG("valkey unavailable");
 }
 
-error_t *find_game(uuid_t id, struct game_t *dest) {
-	char keybuf[UUID_NAME_LEN+2]; // for -m
-	struct valkey_t *vk;
-	struct valkeyReply *reply;
-	error_t *ret;
+static void on_new_game_id(valkeyAsyncContext *c, void *r, void *priv) {
+	struct async_create *ng = priv;
+	valkeyContext *ctx = &c->c;
+	valkeyReply *reply = r;
 
-	uuid_unparse_lower(id, dest->name);
+	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
+		ng->ret = E_VALKEY(ctx, reply);
+		ng->done(ng->priv, ng->ret);
+		free(ng);
+		return;
+	}
 
-	vk = get_valkey();
+	fill_new_game(ng->dest, &ng->user, ng->has_seed ? &ng->seed : NULL, reply->integer);
+	new_game_commands(ng->dest, &ng->user, new_game_async_cmd, ng);
 
-	reply = valkeyCommand(vk->ctx, "HGETALL %s", dest->name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+	// Nothing could be queued so no reply will come to finish it
+	if (ng->pending == 0)
+		async_create_finish(ng);
+}
 
-	if (reply->elements < 2)
-		goto fail_valkey;
+/**
+ * new_game() for the event loop, with the id and the writes sent on the async
+ * connection. done is called once every write has been answered.
+ */
+void new_game_async(int type, struct user_t *user, const uint64_t *seed,
+	struct game_t *dest, game_done_fn *done, void *priv)
+{
+	struct async_create *ng;
+	error_t *ret;
+
+	ret = prepare_new_game(type, dest);
+	if (NOT_OK(ret)) {
+		done(priv, ret);
+		return;
+	}
+
+	ng = calloc(1, sizeof(*ng));
+	if (!ng) {
+		done(priv, E_NOMEM);
+		return;
+	}
+
+	ng->dest = dest;
+	ng->user = *user;
+	ng->has_seed = seed != NULL;
+	if (seed)
+		ng->seed = *seed;
+	ng->done = done;
+	ng->priv = priv;
+
+	if (!async_command(on_new_game_id, ng, "INCR next_game")) {
+		free(ng);
+		done(priv, E_MSG("valkey unavailable"));
+	}
+}
+
+/**
+ * Fill in a user from the reply to HMGET on their hash, returning whether they exist
+ */
+static bool parse_user(struct user_t *user, valkeyReply *reply) {
+	if (reply->elements != 2)
+		return false;
+
+	if (reply->element[0]->type != VALKEY_REPLY_STRING)
+		return false;
+
+	user->id = atoi(reply->element[0]->str);
+	memset(user->realname, 0, sizeof(user->realname));
+	ASSERT(reply->element[1]->len <= USER_NAME_LEN);
+	memcpy(user->realname, reply->element[1]->str, reply->element[1]->len);
+	return true;
+}
+
+/**
+ * The user lookups set *found when the user exists, and only fail when valkey
+ * could not be asked, for example because the pool is busy, so that callers can
+ * tell that apart from a user that does not exist
+ */
+error_t *find_user(uuid_t id, struct user_t *user, bool *found) {
+	struct valkeyReply *reply;
+	error_t *ret;
+
+	*found = false;
+	uuid_unparse_lower(id, user->name);
+
+	ret = valkey_read(&reply, "HMGET %s id name", user->name);
+	if (NOT_OK(ret))
+		return ret;
+
+	*found = parse_user(user, reply);
+	freeReplyObject(reply);
+	return OK;
+}
+
+/**
+ * Look up a user's uuid in one of the index hashes
+ */
+static error_t *find_user_indexed(const char *index, const char *field,
+	struct user_t *user, bool *found)
+{
+	uuid_t user_uuid;
+	struct valkeyReply *reply;
+	error_t *ret;
+
+	*found = false;
+
+	ret = valkey_read(&reply, "HGET %s %s", index, field);
+	if (NOT_OK(ret))
+		return ret;
+
+	if (reply->type != VALKEY_REPLY_STRING)
+		goto not_found;
+
+	if (uuid_parse(reply->str, user_uuid) < 0)
+		goto not_found;
+
+	freeReplyObject(reply);
+	return find_user(user_uuid, user, found);
+
+not_found:
+	freeReplyObject(reply);
+	return OK;
+}
+
+error_t *find_user_by_id(uint32_t id, struct user_t *user, bool *found) {
+	char idbuf[16];
+
+	snprintf(idbuf, sizeof(idbuf), "%u", id);
+	return find_user_indexed("userids", idbuf, user, found);
+}
+
+error_t *find_user_by_name(const char *name, struct user_t *user, bool *found) {
+	return find_user_indexed("usernames", name, user, found);
+}
+
+error_t *find_user_by_string(const char *str, struct user_t *user, bool *found) {
+	uuid_t uuid;
+	error_t *ret;
+	int id;
+
+	if (uuid_parse(str, uuid) == 0)
+		return find_user(uuid, user, found);
+
+	ret = find_user_by_name(str, user, found);
+	if (NOT_OK(ret) || *found)
+		return ret;
+
+	id = atoi(str);
+	return find_user_by_id(id, user, found);
+}
+
+/**
+ * An asynchronous lookup of a user by uuid
+ */
+struct async_user {
+	struct user_t *user;
+	bool *found;
+	game_done_fn *done;
+	void *priv;
+};
+
+static void on_user(valkeyAsyncContext *c, void *r, void *priv) {
+	struct async_user *lookup = priv;
+	valkeyContext *ctx = &c->c;
+	valkeyReply *reply = r;
+	error_t *ret = OK;
+
+	if (!reply || reply->type == VALKEY_REPLY_ERROR)
+		ret = E_VALKEY(ctx, reply);
+	else
+		*lookup->found = parse_user(lookup->user, reply);
+
+	lookup->done(lookup->priv, ret);
+	free(lookup);
+}
+
+/**
+ * find_user() for the event loop
+ */
+void find_user_async(uuid_t id, struct user_t *user, bool *found, game_done_fn *done,
+	void *priv)
+{
+	struct async_user *lookup;
+
+	*found = false;
+	uuid_unparse_lower(id, user->name);
+
+	lookup = calloc(1, sizeof(*lookup));
+	if (!lookup) {
+		done(priv, E_NOMEM);
+		return;
+	}
+
+	lookup->user = user;
+	lookup->found = found;
+	lookup->done = done;
+	lookup->priv = priv;
+
+	if (!async_command(on_user, lookup, "HMGET %s id name", user->name)) {
+		free(lookup);
+		done(priv, E_MSG("valkey unavailable"));
+	}
+}
+
+/**
+ * Aggregates found in a game hash, to be checked against the history once it has
+ * been read as well
+ */
+struct game_load {
+	uint32_t saved_count;
+	bool has_aggregates;
+};
+
+/**
+ * Fill in a game from the reply to HGETALL on its hash
+ */
+static error_t *parse_game_hash(struct game_t *dest, struct game_load *load,
+	valkeyReply *reply)
+{
+	if (reply->type != VALKEY_REPLY_ARRAY || reply->elements < 2)
+		return E_MSG("invalid game");
 
 	// List of 2*n elements of key then value
 	for (size_t i = 0; i < reply->elements; i += 2) {
@@ -596,54 +1105,353 @@ error_t *find_game(uuid_t id, struct game_t *dest) {
 			dest->type = type;
 
 			if (!dest->params)
-				goto fail_valkey;
+				return E_MSG("invalid game type");
 		}
 		else if (STRING_EQUALS(key->str, "next")) {
 			dest->next = (uint8_t) atoi(val->str);
 			dest->has_next = true;
 		}
+		else if (STRING_EQUALS(key->str, "count")) {
+			load->saved_count = atoi(val->str);
+			load->has_aggregates = true;
+		}
+		else if (STRING_EQUALS(key->str, "accepted")) {
+			dest->accepted = atoi(val->str);
+		}
+		else if (STRING_EQUALS(key->str, "history")) {
+			dest->history = (uint8_t) atoi(val->str);
+		}
+		else if (STRING_EQUALS(key->str, "seed")) {
+			dest->seed = strtoull(val->str, NULL, 10);
+		}
+		else if (STRING_EQUALS(key->str, "seeded")) {
+			dest->seeded = atoi(val->str) != 0;
+		}
+		else if (STRING_EQUALS(key->str, "terminated")) {
+			dest->terminated = atoi(val->str) != 0;
+		}
+		else if (key->str[0] == 'a' && isdigit(key->str[1])) {
+			size_t attr = atoi(key->str + 1);
+			if (attr < MAX_ATTRS)
+				dest->attr_n[attr] = atoi(val->str);
+		}
 	}
 
-	snprintf(keybuf, sizeof(keybuf), "%s-m", dest->name);
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "GET %s", keybuf);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+	return OK;
+}
+
+/**
+ * Fill in a packed history, which is always written along with the aggregates so
+ * they are known to match. Seeded games get their patrons drawn again.
+ */
+static error_t *parse_packed_history(struct game_t *dest, struct game_load *load,
+	valkeyReply *reply)
+{
+	size_t n = stored_attrs(dest, dest->history);
+	uint32_t count = load->saved_count;
+	error_t *ret;
+
+	if (dest->history != HISTORY_PACKED && dest->history != HISTORY_SEEDED)
+		return E_MSG("unknown history format");
+
+	if (!load->has_aggregates || reply->len < HISTORY_BYTES(count, HISTORY_WIDTH(n)))
+		return E_MSG("invalid game history");
 
 	// Add 1 to length for a potential next person
-	dest->seen = calloc(reply->len+1, 1);
-	if (!dest->seen) {
-		ret = E_NOMEM;
-		goto fail_err;
+	ret = game_reserve(dest, count+1);
+	if (NOT_OK(ret))
+		return ret;
+
+	history_unpack(dest->seen, (const uint8_t *) reply->str, count, n);
+	dest->count = count;
+
+	if (dest->history == HISTORY_SEEDED) {
+		for (uint32_t i = 0; i < count; ++i)
+			dest->seen[i] |= generate_person_at(dest->params, dest->seed, i);
 	}
 
+	reset_goal_margins(dest);
+	if (game_is_finished(dest))
+		dest->goals_satisfied = check_goals(dest);
+
+	return OK;
+}
+
+/**
+ * Fill in the history of a game from the reply to GET on one of its history keys,
+ * once the hash has been parsed. Both keys are read together, and the reply for
+ * the one not in the format the hash names is ignored.
+ */
+static error_t *parse_game_history(struct game_t *dest, struct game_load *load,
+	valkeyReply *reply, bool packed)
+{
+	error_t *ret;
+
+	if (packed != (dest->history != 0))
+		return OK;
+
+	if (!dest->params)
+		return E_MSG("invalid game");
+
+	if (packed)
+		return parse_packed_history(dest, load, reply);
+
+	// Add 1 to length for a potential next person
+	ret = game_reserve(dest, reply->len+1);
+	if (NOT_OK(ret))
+		return ret;
+
 	memcpy(dest->seen, reply->str, reply->len);
 	dest->count = (uint32_t) reply->len;
-	game_update(dest);
-	freeReplyObject(reply);
-	release_valkey(vk);
+
+	// Aggregates are written after the history, so if they disagree the history
+	// was extended without them and they have to be rebuilt
+	if (load->has_aggregates && load->saved_count == dest->count) {
+		reset_goal_margins(dest);
+		if (game_is_finished(dest))
+			dest->goals_satisfied = check_goals(dest);
+	}
+	else {
+		game_recount(dest);
+	}
+
 	return OK;
+}
 
-fail_valkey:
-	ret = E_VALKEY(vk->ctx, reply);
-fail_err:
-	freeReplyObject(reply);
+/**
+ * Read a game and its history from valkey into dest
+ */
+static error_t *load_game(uuid_t id, struct game_t *dest) {
+	char keybuf[UUID_NAME_LEN+2]; // for -m
+	char packed_key[UUID_NAME_LEN+2];
+	struct valkey_t *vk;
+	struct valkey_batch batch;
+	struct game_load load = {0};
+	error_t *ret;
+
+	uuid_unparse_lower(id, dest->name);
+	snprintf(keybuf, sizeof(keybuf), "%s-m", dest->name);
+	snprintf(packed_key, sizeof(packed_key), "%s-h", dest->name);
+
+	// The hash and the history are independent so fetch both in one round trip,
+	// and being reads they can be sent again if the connection drops
+	for (size_t attempt = 0; ; ++attempt) {
+		vk = get_valkey();
+		if (!vk)
+			return E_VALKEY_BUSY;
+
+		valkey_batch_init(&batch, vk);
+		valkey_batch_add(&batch, "HGETALL %s", dest->name);
+		valkey_batch_add(&batch, "GET %s", keybuf);
+		valkey_batch_add(&batch, "GET %s", packed_key);
+
+		ret = valkey_batch_run(&batch);
+		if (ret == OK || !valkey_retry(vk, attempt))
+			break;
+
+		error_free(ret);
+		valkey_batch_free(&batch);
+		release_valkey(vk);
+	}
+
+	if (NOT_OK(ret))
+		goto done;
+
+	ret = parse_game_hash(dest, &load, batch.replies[0]);
+	if (NOT_OK(ret))
+		goto done;
+
+	ret = parse_game_history(dest, &load, batch.replies[1], false);
+	if (NOT_OK(ret))
+		goto done;
+
+	ret = parse_game_history(dest, &load, batch.replies[2], true);
+
+done:
+	valkey_batch_free(&batch);
 	release_valkey(vk);
 	return ret;
 }
 
+/**
+ * Move a freshly loaded game into the cache, leaving dest as the cached copy.
+ * Without room in the cache the caller just keeps its own copy.
+ */
+static void cache_game(uuid_t id, struct game_t *dest) {
+	struct game_cache_entry *entry;
+
+	entry = game_cache_insert(id, dest);
+	if (!entry)
+		return;
+
+	*dest = entry->game;
+	dest->entry = entry;
+}
+
+/**
+ * Find a game, from the in memory cache if it is there and from valkey otherwise.
+ * A cached game stays locked until release_game() so that only one request works
+ * on it at a time, and any changes are kept in the cache when it is released.
+ */
+error_t *find_game(uuid_t id, struct game_t *dest) {
+	struct game_cache_entry *entry;
+	error_t *ret;
+
+	entry = game_cache_acquire(id);
+	if (entry) {
+		if (!entry->stale)
+			goto found;
+
+		// Dropped while we waited for it, so load a fresh copy
+		game_cache_release(entry, true);
+	}
+
+	memset(dest, 0, sizeof(*dest));
+	ret = load_game(id, dest);
+	if (NOT_OK(ret)) {
+		release_game(dest);
+		return ret;
+	}
+
+	cache_game(id, dest);
+	return OK;
+
+found:
+	*dest = entry->game;
+	dest->entry = entry;
+	return OK;
+}
+
+/**
+ * An asynchronous load of a game, finished when both of its replies are in
+ */
+struct async_load {
+	uuid_t id;
+	struct game_t *dest;
+	struct game_load load;
+	game_done_fn *done;
+	void *priv;
+	size_t pending;
+	error_t *ret;
+};
+
+static void async_load_step(struct async_load *load) {
+	load->pending -= 1;
+	if (load->pending > 0)
+		return;
+
+	if (NOT_OK(load->ret))
+		release_game(load->dest);
+	else
+		cache_game(load->id, load->dest);
+
+	load->done(load->priv, load->ret);
+	free(load);
+}
+
+static void on_game_hash(valkeyAsyncContext *c, void *r, void *priv) {
+	struct async_load *load = priv;
+	valkeyContext *ctx = &c->c;
+	valkeyReply *reply = r;
+
+	if (load->ret == OK) {
+		if (!reply || reply->type == VALKEY_REPLY_ERROR)
+			load->ret = E_VALKEY(ctx, reply);
+		else
+			load->ret = parse_game_hash(load->dest, &load->load, reply);
+	}
+
+	async_load_step(load);
+}
+
+static void on_history(valkeyAsyncContext *c, valkeyReply *reply,
+	struct async_load *load, bool packed)
+{
+	valkeyContext *ctx = &c->c;
+
+	if (load->ret == OK) {
+		if (!reply || reply->type == VALKEY_REPLY_ERROR)
+			load->ret = E_VALKEY(ctx, reply);
+		else
+			load->ret = parse_game_history(load->dest, &load->load, reply, packed);
+	}
+
+	async_load_step(load);
+}
+
+static void on_game_history(valkeyAsyncContext *c, void *r, void *priv) {
+	on_history(c, r, priv, false);
+}
+
+static void on_game_packed(valkeyAsyncContext *c, void *r, void *priv) {
+	on_history(c, r, priv, true);
+}
+
+/**
+ * find_game() for the event loop. A cached game completes straight away, otherwise
+ * the hash and history are requested on the async connection.
+ */
+void find_game_async(uuid_t id, struct game_t *dest, game_done_fn *done, void *priv) {
+	char keybuf[UUID_NAME_LEN+2];
+	char packed_key[UUID_NAME_LEN+2];
+	struct game_cache_entry *entry;
+	struct async_load *load;
+
+	entry = game_cache_acquire(id);
+	if (entry) {
+		if (!entry->stale) {
+			*dest = entry->game;
+			dest->entry = entry;
+			done(priv, OK);
+			return;
+		}
+
+		game_cache_release(entry, true);
+	}
+
+	memset(dest, 0, sizeof(*dest));
+	uuid_unparse_lower(id, dest->name);
+	snprintf(keybuf, sizeof(keybuf), "%s-m", dest->name);
+	snprintf(packed_key, sizeof(packed_key), "%s-h", dest->name);
+
+	load = calloc(1, sizeof(*load));
+	if (!load) {
+		done(priv, E_NOMEM);
+		return;
+	}
+
+	uuid_copy(load->id, id);
+	load->dest = dest;
+	load->done = done;
+	load->priv = priv;
+
+	if (!async_command(on_game_hash, load, "HGETALL %s", dest->name)) {
+		free(load);
+		done(priv, E_MSG("valkey unavailable"));
+		return;
+	}
+
+	// The hash reply is still to come so it finishes the load either way
+	load->pending = 1;
+	if (async_command(on_game_history, load, "GET %s", keybuf))
+		load->pending += 1;
+	else
+		load->ret = E_MSG("valkey unavailable");
+
+	if (async_command(on_game_packed, load, "GET %s", packed_key))
+		load->pending += 1;
+	else if (load->ret == OK)
+		load->ret = E_MSG("valkey unavailable");
+}
+
 error_t *find_game_by_id(uint32_t id, struct game_t *dest) {
 	uuid_t uuid;
-	struct valkey_t *vk;
 	valkeyReply *reply;
-	error_t *ret = OK;
+	error_t *ret;
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "HGET gameids %d", id);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		ret = E_VALKEY(vk->ctx, reply);
-		goto done;
-	}
+	ret = valkey_read(&reply, "HGET gameids %d", id);
+	if (NOT_OK(ret))
+		return ret;
 
 	if (reply->type != VALKEY_REPLY_STRING) {
 		ret = E_MSG("invalid game id");
@@ -656,12 +1464,10 @@ error_t *find_game_by_id(uint32_t id, struct game_t *dest) {
 	}
 
 	freeReplyObject(reply);
-	release_valkey(vk);
 	return find_game(uuid, dest);
 
 done:
 	freeReplyObject(reply);
-	release_valkey(vk);
 	return ret;
 }
 
@@ -673,56 +1479,340 @@ error_t *find_game_string(const char *str, struct game_t *dest) {
 	return find_game_by_id(atoi(str), dest);
 }
 
+/**
+ * Summarize a game from before summaries were kept by loading all of it. Finished
+ * games cannot change so their summary is written back for next time.
+ */
+static void summary_from_game(struct game_summary *summary) {
+	struct game_t game = {0};
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	char buf[GAME_SUMMARY_LEN];
+	error_t *ret;
+
+	ret = find_game_by_id(summary->id, &game);
+	if (NOT_OK(ret)) {
+		error_free(ret);
+		return;
+	}
+
+	summarize_game(&game, summary);
+
+	if (summary->status != GAME_RUNNING) {
+		format_summary(buf, &game);
+
+		vk = get_valkey();
+		if (vk) {
+			reply = valkeyCommand(vk->ctx, "HSET %s %u %s", VALKEY_SUMMARIES, game.id,
+				buf);
+			if (!reply || reply->type == VALKEY_REPLY_ERROR)
+				DEBUG("failed to save summary for game %u\n", game.id);
+			freeReplyObject(reply);
+			release_valkey(vk);
+		}
+	}
+
+	release_game(&game);
+}
+
+/**
+ * Fill in the summaries for the games whose ids are set in out, reading all of them
+ * with one HMGET
+ */
+error_t *find_game_summaries(struct game_summary *out, size_t n) {
+	const char **argv = NULL;
+	size_t *argvlen = NULL;
+	char (*ids)[16] = NULL;
+	valkeyReply *reply;
+	error_t *ret;
+
+	if (n == 0)
+		return OK;
+
+	argv = calloc(n + 2, sizeof(*argv));
+	argvlen = calloc(n + 2, sizeof(*argvlen));
+	ids = calloc(n, sizeof(*ids));
+	if (!argv || !argvlen || !ids) {
+		ret = E_NOMEM;
+		goto done;
+	}
+
+	argv[0] = "HMGET";
+	argv[1] = VALKEY_SUMMARIES;
+	for (size_t i = 0; i < n; ++i) {
+		snprintf(ids[i], sizeof(ids[i]), "%u", out[i].id);
+		argv[i + 2] = ids[i];
+	}
+
+	for (size_t i = 0; i < n + 2; ++i)
+		argvlen[i] = strlen(argv[i]);
+
+	ret = valkey_read_argv(&reply, n + 2, argv, argvlen);
+	if (NOT_OK(ret))
+		goto done;
+
+	for (size_t i = 0; i < n; ++i) {
+		valkeyReply *elem = i < reply->elements ? reply->element[i] : NULL;
+		int status;
+
+		out[i].found = false;
+		if (elem && elem->type == VALKEY_REPLY_STRING &&
+			sscanf(elem->str, "%u %u %d %d", &out[i].count, &out[i].accepted,
+				&out[i].type, &status) == 4)
+		{
+			out[i].status = (enum game_status) status;
+			out[i].found = true;
+			continue;
+		}
+
+		summary_from_game(&out[i]);
+	}
+
+	freeReplyObject(reply);
+
+done:
+	free(argv);
+	free(argvlen);
+	free(ids);
+	return ret;
+}
+
+/**
+ * Finished games are not played any more so they leave the cache, as does anything
+ * that might disagree with valkey after a failed write
+ */
 void release_game(struct game_t *game) {
+	struct game_cache_entry *entry = game->entry;
+
+	if (entry) {
+		game->entry = NULL;
+		entry->game = *game;
+		game_cache_release(entry, game->stale || game_is_finished(game));
+		return;
+	}
+
 	if (game->seen)
 		free(game->seen);
+	game->seen = NULL;
 }
 
-error_t *process_next_person(struct game_t *game, bool verdict) {
-	struct valkey_t *vk;
+/**
+ * Let other requests at a cached game between the moves of a long lived session,
+ * while keeping it pinned in the cache. Any changes are kept in the cache.
+ */
+void park_game(struct game_t *game) {
+	struct game_cache_entry *entry = game->entry;
+
+	if (!entry)
+		return;
+
+	entry->game = *game;
+	game_cache_unlock(entry);
+}
+
+/**
+ * Pick a parked game up again, including anything done to it in the meantime. If
+ * another request dropped it from the cache the game is loaded again from valkey.
+ */
+error_t *unpark_game(struct game_t *game) {
+	struct game_cache_entry *entry = game->entry;
+	uuid_t id;
+
+	if (!entry)
+		return OK;
+
+	game_cache_lock(entry);
+	if (!entry->stale) {
+		*game = entry->game;
+		game->entry = entry;
+		return OK;
+	}
+
+	uuid_copy(id, entry->id);
+	game->entry = NULL;
+	game_cache_release(entry, true);
+	return find_game(id, game);
+}
+
+/**
+ * Apply a verdict to the pending patron in memory and, if the game goes on, draw the
+ * next one. Everything in the history from start onwards then needs committing, and
+ * the game is only changed if this succeeds.
+ */
+static error_t *apply_verdict(struct game_t *game, bool verdict, uint32_t *start) {
 	uint8_t attr;
-	uint32_t offset;
-	char keybuf[40];
-	valkeyReply *reply;
 	error_t *ret;
 
-	if (game->accepted >= ACCEPTED_LIMIT || game->count >= LOSS_LIMIT)
+	if (game_is_finished(game))
 		return E_MSG("game finished");
 
 	if (!game->has_next)
 		return E_MSG("no patron available");
 
-	snprintf(keybuf, sizeof(keybuf), "%s-m", game->name);
-
 	attr = game->next;
-	offset = game->count;
+	*start = game->count;
 	if (verdict)
 		attr |= BIT_ATTR_ACCEPT;
 
-	vk = get_valkey();
+	ret = game_reserve(game, game->count+2);
+	if (NOT_OK(ret))
+		return ret;
 
-	reply = valkeyCommand(vk->ctx, "HDEL %s next", game->name);
-	if (!reply || (reply->type == VALKEY_REPLY_ERROR))
-		goto failure;
+	game_add_person(game, attr);
+	game->has_next = false;
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "SETRANGE %s %d %b", keybuf, offset, &attr,
-		sizeof(attr));
-	if (!reply || (reply->type == VALKEY_REPLY_ERROR))
-		goto failure;
+	// Only live moves end a game early, so replaying a history never does
+	if (early_end && !game_is_finished(game) && goals_outlook(game) != GOALS_OPEN) {
+		game->terminated = true;
+		game->goals_satisfied = check_goals(game);
+	}
 
-	game->seen[game->count] = attr;
-	game->count += 1;
-	game_update(game);
+	if (!game_is_finished(game)) {
+		game->next = next_person(game);
+		game->has_next = true;
+	}
 
-	freeReplyObject(reply);
-	release_valkey(vk);
 	return OK;
+}
+
+/**
+ * Apply a verdict to the pending patron and, if the game goes on, draw the next one.
+ * Both are written to valkey together, so a game is never left without a patron.
+ */
+error_t *process_next_person(struct game_t *game, bool verdict) {
+	uint32_t start;
+	error_t *ret;
+
+	ret = apply_verdict(game, verdict, &start);
+	if (NOT_OK(ret))
+		return ret;
+
+	ret = commit_moves(game, start);
+	if (NOT_OK(ret))
+		game->stale = true;
+
+	return ret;
+}
+
+/**
+ * Decide the pending patron and up to k-1 more with a policy fixed in advance,
+ * accepting exactly the patrons whose attribute combination has its bit set. Each
+ * patron is only drawn after the previous one is decided, so this is the same as
+ * k single verdicts from a player that cannot see ahead, and all of them are
+ * committed together. Stops early if the game finishes.
+ */
+error_t *process_policy(struct game_t *game, const uint64_t policy[POLICY_WORDS],
+	uint32_t k)
+{
+	uint32_t start = game->count;
+	uint32_t first;
+	error_t *ret;
+
+	if (k == 0)
+		return E_MSG("no patrons to decide");
+
+	for (uint32_t i = 0; i < k && !game_is_finished(game); ++i) {
+		uint8_t attr = game->next;
+		bool verdict = (policy[attr / 64] >> (attr % 64)) & 1;
+
+		ret = apply_verdict(game, verdict, &first);
+		if (NOT_OK(ret)) {
+			// Nothing is lost if the first verdict failed, otherwise what was
+			// applied can no longer be trusted
+			if (game->count != start)
+				game->stale = true;
+			return ret;
+		}
+	}
+
+	ret = commit_moves(game, start);
+	if (NOT_OK(ret))
+		game->stale = true;
 
-failure:
-	ret = E_VALKEY(vk->ctx, reply);
-	freeReplyObject(reply);
-	release_valkey(vk);
 	return ret;
 }
 
+/**
+ * An asynchronous commit of a verdict
+ */
+struct async_moves {
+	struct game_t *game;
+	game_done_fn *done;
+	void *priv;
+};
+
+static void on_moves(valkeyAsyncContext *c, void *r, void *priv) {
+	struct async_moves *moves = priv;
+	struct game_t *game = moves->game;
+	struct game_cache_entry *entry = game->entry;
+	error_t *ret;
+
+	// Pick up the game again, including anything done to it while we waited
+	if (entry) {
+		game_cache_lock(entry);
+		*game = entry->game;
+		game->entry = entry;
+	}
+
+	ret = moves_result(game, &c->c, r);
+	if (NOT_OK(ret)) {
+		game->stale = true;
+	}
+	else {
+		if (!game->history)
+			game->history = HISTORY_PACKED;
+		recent_update(game);
+	}
+
+	moves->done(moves->priv, ret);
+	free(moves);
+}
+
+/**
+ * process_next_person() for the event loop. The verdict is applied in memory and
+ * the commit queued on the async connection, and a cached game is unlocked until
+ * the reply arrives so that other requests on the loop can use it. Commits for a
+ * game are applied by valkey in the order they were queued, and the script rejects
+ * any that no longer follow on from the history.
+ */
+void process_next_person_async(struct game_t *game, bool verdict, game_done_fn *done,
+	void *priv)
+{
+	struct game_cache_entry *entry = game->entry;
+	struct moves_args args;
+	struct async_moves *moves;
+	uint32_t start;
+	error_t *ret;
+
+	ret = apply_verdict(game, verdict, &start);
+	if (NOT_OK(ret)) {
+		done(priv, ret);
+		return;
+	}
+
+	moves = calloc(1, sizeof(*moves));
+	if (!moves) {
+		game->stale = true;
+		done(priv, E_NOMEM);
+		return;
+	}
+
+	moves->game = game;
+	moves->done = done;
+	moves->priv = priv;
+
+	moves_args(&args, game, start);
+	if (!async_eval(on_moves, moves, &moves_script, MOVES_SCRIPT_KEYS, args.argc,
+		args.argv, args.argvlen))
+	{
+		free(moves);
+		game->stale = true;
+		done(priv, E_MSG("valkey unavailable"));
+		return;
+	}
+
+	if (entry) {
+		entry->game = *game;
+		game_cache_unlock(entry);
+	}
+}
@@ -8,16 +8,16 @@
 
 #include <libgjm/errors.h>
 #include <libgjm/util.h>
-#include <libgjm/well.h>
 
+#include "attrs.h"
 #include "goal.h"
 
 // Maximum venue capacity
 #define ACCEPTED_LIMIT 1000
 #define LOSS_LIMIT (20000 + ACCEPTED_LIMIT)
 
-// Maximum number of attrs permitted
-#define MAX_ATTRS 7
+// Maximum number of goals in a parameter set
+#define MAX_GOALS 8
 
 // A person is encoded as accepted by setting a reserved bit in their attribute
 // vector
@@ -32,6 +32,23 @@
 #define VALKEY_USER_GAME_HISTORY 100
 #define RECENT_GAME_LIMIT 100
 
+// Hash of game summaries by id, and the longest summary
+#define VALKEY_SUMMARIES "summaries"
+#define GAME_SUMMARY_LEN 48
+
+// Prefix of the sorted sets ranking won games, and the most entries one request
+// may ask for
+#define VALKEY_LEADERBOARD "leaderboard"
+#define LEADERBOARD_LIMIT 100
+
+// Initial allocation for a game's history, it grows as needed from there
+#define GAME_SEEN_INITIAL 1024
+
+// A policy has one accept bit for every combination of attributes
+#define POLICY_WORDS (BIT(MAX_ATTRS) / 64)
+
+struct game_cache_entry;
+
 struct game_params_t {
 	struct gen_params {
 		size_t n;
@@ -43,6 +60,11 @@ struct game_params_t {
 	struct {
 		double *marginals;
 		double *corr;
+		// Probability of each attribute combination, and the alias tables used
+		// to sample from it
+		double joint[BIT(MAX_ATTRS)];
+		uint32_t alias_prob[BIT(MAX_ATTRS)];
+		uint8_t alias[BIT(MAX_ATTRS)];
 	} dist_params;
 
 	size_t n_goals;
@@ -55,9 +77,23 @@ struct game_params_t {
  *  id -> integer
  *  userid -> integer
  *  type -> integer
+ *  history -> integer, format of the history, absent for the original one
+ *  seed -> integer, the seed patrons are drawn from in seeded games
+ *  seeded -> integer, 1 if the client chose the seed, and the game is not ranked
  *  next -> integer
+ *  count -> integer, number of people in the history when aggregates were saved
+ *  accepted -> integer
+ *  a0..a6 -> integer, accepted count for each attribute
+ *  terminated -> integer, 1 if the game ended early because its goals were settled
+ *
+ * string keyed by uuid-h, the history packed as in history.c, or for games
+ * without a history version, string keyed by uuid-m with one byte per patron
  *
- * string keyed by uuid-m
+ * and every game has a field in the summaries hash, keyed by id, holding
+ * "count accepted type status" so that lists of games are a single HMGET
+ *
+ * won games are ranked in the sorted set leaderboard-<type> by score, with
+ * members game ids, and leaderboard-<type>-users holds each user's best score
  */
 struct game_t {
 	char name[UUID_NAME_LEN];
@@ -67,12 +103,16 @@ struct game_t {
 	struct game_params_t *params;
 
 	bool goals_satisfied;
+	// Ended before the limits because the goals could no longer change outcome
+	bool terminated;
 
 	// Total number accepted
 	uint32_t accepted;
 	// Total number reviewed (accepted + rejected, does not include next)
 	uint32_t count;
 	uint32_t attr_n[MAX_ATTRS];
+	// Margin of each goal, kept up to date as patrons are accepted
+	int32_t goal_margin[MAX_GOALS];
 
 	// Is there a pending person
 	bool has_next;
@@ -80,6 +120,38 @@ struct game_t {
 	uint8_t next;
 
 	uint8_t *seen;
+	// Allocated length of seen
+	uint32_t seen_size;
+	// Format the history is stored in, one of the HISTORY_ values or 0 for the
+	// original
+	uint8_t history;
+	// Patron i of a HISTORY_SEEDED game is generate_person_at(params, seed, i)
+	uint64_t seed;
+	// The client chose the seed, so the game is kept off the leaderboards
+	bool seeded;
+
+	// Cache entry this game was loaded from, if any, and whether the in memory copy
+	// may no longer match valkey
+	struct game_cache_entry *entry;
+	bool stale;
+};
+
+enum game_status {
+	GAME_RUNNING,
+	GAME_COMPLETED,
+	GAME_FAILED,
+};
+
+/**
+ * What lists of games show for each one. found is false for ids with no game.
+ */
+struct game_summary {
+	uint32_t id;
+	uint32_t count;
+	uint32_t accepted;
+	int type;
+	enum game_status status;
+	bool found;
 };
 
 struct user_t {
@@ -88,26 +160,53 @@ struct user_t {
 	uint32_t id;
 };
 
+/**
+ * Completion for the asynchronous game operations, called exactly once on the event
+ * loop thread, possibly before the operation that was given it returns
+ */
+typedef void (game_done_fn)(void *priv, error_t *err);
+
+error_t *init_game_params(void);
 error_t *init_game(void);
+void init_game_async(void);
 bool valid_game_type(size_t type);
+void game_set_early_end(bool enable);
 bool game_is_finished(struct game_t *game);
+enum game_status game_status(struct game_t *game);
+void summarize_game(struct game_t *game, struct game_summary *out);
+uint32_t game_score(struct game_t *game);
+void leaderboard_key(char *buf, size_t len, int type, bool users);
 void get_normals(double *a, double *b);
 uint32_t generate_attributes(size_t n, double *t, double *a);
+uint32_t generate_person(struct game_params_t *params);
+uint32_t generate_person_at(struct game_params_t *params, uint64_t seed, uint32_t i);
 struct game_params_t *get_game_params(int type);
 size_t get_number_of_games(void);
 
-error_t *new_game(int type, struct user_t *user, struct game_t *dest);
-error_t *create_next_person(struct game_t *game);
+error_t *new_game(int type, struct user_t *user, const uint64_t *seed,
+	struct game_t *dest);
+void new_game_async(int type, struct user_t *user, const uint64_t *seed,
+	struct game_t *dest, game_done_fn *done, void *priv);
 error_t *process_next_person(struct game_t *game, bool verdict);
-
-bool find_user(uuid_t id, struct user_t *user);
-bool find_user_by_id(uint32_t id, struct user_t *user);
-bool find_user_by_name(const char *name, struct user_t *user);
-bool find_user_by_string(const char *str, struct user_t *user);
+error_t *process_policy(struct game_t *game, const uint64_t policy[POLICY_WORDS],
+	uint32_t k);
+void process_next_person_async(struct game_t *game, bool verdict, game_done_fn *done,
+	void *priv);
+
+error_t *find_user(uuid_t id, struct user_t *user, bool *found);
+error_t *find_user_by_id(uint32_t id, struct user_t *user, bool *found);
+error_t *find_user_by_name(const char *name, struct user_t *user, bool *found);
+error_t *find_user_by_string(const char *str, struct user_t *user, bool *found);
+void find_user_async(uuid_t id, struct user_t *user, bool *found, game_done_fn *done,
+	void *priv);
 
 error_t *find_game(uuid_t id, struct game_t *dest);
+void find_game_async(uuid_t id, struct game_t *dest, game_done_fn *done, void *priv);
 error_t *find_game_by_id(uint32_t id, struct game_t *dest);
 error_t *find_game_string(const char *str, struct game_t *dest);
+error_t *find_game_summaries(struct game_summary *out, size_t n);
 void release_game(struct game_t *game);
+void park_game(struct game_t *game);
+error_t *unpark_game(struct game_t *game);
 
 #endif
@@ -11,27 +11,19 @@
 #include "goal.h"
 #include "game.h"
 
-static int32_t decode_value(struct game_t *game, uint32_t param) {
-	if (is_flag_set(param, GOAL_ATTR_BIT)) {
-		return (int32_t) game->attr_n[GOAL_VALUE(param)];
-	}
-
-	return (int32_t) sign_extend(GOAL_VALUE(param), 12);
-}
-
-static int32_t apply_op(int32_t op, int32_t a, int32_t b) {
+static int32_t apply_op(uint8_t op, int32_t a, int32_t b) {
 	switch (op) {
-	case GOAL_OPER_PLUS:
+	case GOAL_OP_PLUS:
 		return a + b;
-	case GOAL_OPER_MINUS:
+	case GOAL_OP_MINUS:
 		return a - b;
-	case GOAL_OPER_DIV:
-		return a / b;
-	case GOAL_OPER_MULT:
+	case GOAL_OP_DIV:
+		return b ? a / b : 0;
+	case GOAL_OP_MULT:
 		return a * b;
-	case GOAL_OPER_LT:
+	case GOAL_OP_LT:
 		return a < b;
-	case GOAL_OPER_GE:
+	case GOAL_OP_GE:
 		return a >= b;
 	}
 
@@ -39,44 +31,395 @@ static int32_t apply_op(int32_t op, int32_t a, int32_t b) {
 	return 0;
 }
 
-static int32_t goal_param(struct game_t *game, struct goal_t *goal) {
-	int32_t compute[128] = {0};
-	size_t i = 0;
+struct goal_compiler {
+	const uint32_t *params;
+	size_t pos;
+	size_t n_attrs;
+	uint8_t attrs;
+	struct goal_program *prog;
+};
+
+static error_t *emit(struct goal_compiler *c, uint8_t op, int32_t arg) {
+	struct goal_program *prog = c->prog;
+
+	if (prog->n >= GOAL_PROGRAM_MAX)
+		return E_MSG("goal is too long");
+
+	prog->insn[prog->n].op = op;
+	prog->insn[prog->n].arg = arg;
+	prog->n += 1;
+	return OK;
+}
+
+/**
+ * Emit a binary operator, folding it into a constant if both operands are
+ * constants. A divisor that is a constant zero is an error, folded or not.
+ */
+static error_t *emit_op(struct goal_compiler *c, uint8_t op) {
+	struct goal_program *prog = c->prog;
+	struct goal_insn *a = &prog->insn[prog->n-2];
+	struct goal_insn *b = &prog->insn[prog->n-1];
+
+	if (op == GOAL_OP_DIV && b->op == GOAL_OP_CONST && b->arg == 0)
+		return E_MSG("goal divides by zero");
+
+	if (a->op == GOAL_OP_CONST && b->op == GOAL_OP_CONST) {
+		a->arg = apply_op(op, a->arg, b->arg);
+		prog->n -= 1;
+		return OK;
+	}
+
+	return emit(c, op, 0);
+}
+
+/**
+ * Compile one prefix expression starting at c->pos, when depth values are already
+ * on the stack
+ */
+static error_t *compile_expr(struct goal_compiler *c, size_t depth) {
+	uint32_t param = c->params[c->pos];
+	error_t *ret;
+
+	if (is_flag_set(param, GOAL_TAIL_BIT))
+		return E_MSG("goal is missing an operand");
+
+	// Each token emits at most one instruction, so this also bounds the recursion
+	if (c->pos >= GOAL_PROGRAM_MAX)
+		return E_MSG("goal is too long");
+	c->pos += 1;
+
+	if (is_flag_set(param, GOAL_OPER_BIT)) {
+		uint32_t oper = GOAL_VALUE(param);
+
+		if (oper > GOAL_VALUE(GOAL_OPER_GE))
+			return E_MSG("goal has an unknown operator");
+
+		ret = compile_expr(c, depth);
+		if (NOT_OK(ret))
+			return ret;
+
+		ret = compile_expr(c, depth + 1);
+		if (NOT_OK(ret))
+			return ret;
+
+		return emit_op(c, GOAL_OP_PLUS + oper);
+	}
+
+	if (depth + 1 > GOAL_STACK_MAX)
+		return E_MSG("goal needs too deep a stack");
+
+	if (is_flag_set(param, GOAL_ATTR_BIT)) {
+		if (GOAL_VALUE(param) >= c->n_attrs)
+			return E_MSG("goal uses an unknown attribute");
+		c->attrs |= BIT(GOAL_VALUE(param));
+		return emit(c, GOAL_OP_ATTR, GOAL_VALUE(param));
+	}
+
+	return emit(c, GOAL_OP_CONST, sign_extend(GOAL_VALUE(param), 12));
+}
+
+static int32_t run_program(const struct goal_program *prog, const uint32_t *attr_n) {
+	int32_t stack[GOAL_STACK_MAX];
 	size_t j = 0;
-	bool has_input = true;
-
-	while (has_input || j > 2) {
-		// Process any completed expressions on the stack
-		while (j > 2
-			&& is_flag_set(compute[j-3], GOAL_OPER_BIT)
-			&& !is_flag_set(compute[j-2], GOAL_OPER_BIT)
-			&& !is_flag_set(compute[j-1], GOAL_OPER_BIT))
-		{
-			uint32_t op = compute[j-3];
-			int32_t a = decode_value(game, compute[j-2]);
-			int32_t b = decode_value(game, compute[j-1]);
-			int32_t result = apply_op(op, a, b);
-			compute[j-3] = result;
-			j = j - 2;
+
+	for (size_t i = 0; i < prog->n; ++i) {
+		const struct goal_insn *insn = &prog->insn[i];
+
+		switch (insn->op) {
+		case GOAL_OP_CONST:
+			stack[j++] = insn->arg;
+			break;
+		case GOAL_OP_ATTR:
+			stack[j++] = (int32_t) attr_n[insn->arg];
+			break;
+		default:
+			stack[j-2] = apply_op(insn->op, stack[j-2], stack[j-1]);
+			j -= 1;
+			break;
 		}
+	}
+
+	return stack[0];
+}
+
+/**
+ * Turn a compiled comparison into its margin, lhs - rhs for GE and rhs - lhs - 1
+ * for LT, so that it is met exactly when the margin is not negative. Goals that
+ * are not a comparison get no margin program.
+ */
+static error_t *compile_margin(struct goal_compiler *c, struct goal_t *goal) {
+	struct goal_program *margin = &goal->margin;
+	uint8_t last = goal->prog.insn[goal->prog.n-1].op;
+
+	margin->n = 0;
+	if (last != GOAL_OP_GE && last != GOAL_OP_LT)
+		return OK;
+
+	*margin = goal->prog;
+	margin->insn[margin->n-1].op = GOAL_OP_MINUS;
+	if (last == GOAL_OP_GE)
+		return OK;
+
+	if (margin->n + 4 > GOAL_PROGRAM_MAX)
+		return E_MSG("goal is too long");
+
+	c->prog = margin;
+	emit(c, GOAL_OP_CONST, -1);
+	emit(c, GOAL_OP_MULT, 0);
+	emit(c, GOAL_OP_CONST, 1);
+	emit(c, GOAL_OP_MINUS, 0);
+	return OK;
+}
 
-		// Push more data onto the stack if available
-		if (!is_flag_set(goal->params[i], GOAL_TAIL_BIT)) {
-			compute[j] = goal->params[i];
+/**
+ * The most that accepting one patron can raise a goal's margin, found by trying
+ * every combination of attributes from zero counts. This is exact for goals that
+ * are linear in the counts and an estimate for the others.
+ */
+static int32_t margin_gain(const struct goal_t *goal, size_t n_attrs) {
+	uint32_t attr_n[MAX_ATTRS] = {0};
+	int32_t base = goal_margin(goal, attr_n);
+	int32_t gain = 0;
+
+	for (uint32_t combo = 1; combo < BIT(n_attrs); ++combo) {
+		int32_t delta;
+
+		for (size_t i = 0; i < n_attrs; ++i)
+			attr_n[i] = is_flag_set(combo, BIT(i)) ? 1 : 0;
+
+		delta = goal_margin(goal, attr_n) - base;
+		if (delta > gain)
+			gain = delta;
+	}
+
+	return gain;
+}
+
+/**
+ * Compile a goal's prefix params into a postfix program, checking that it is a
+ * single well formed expression over attributes below n_attrs
+ */
+error_t *compile_goal(struct goal_t *goal, size_t n_attrs) {
+	struct goal_compiler c = {
+		.params = goal->params,
+		.n_attrs = n_attrs,
+		.prog = &goal->prog,
+	};
+	error_t *ret;
+
+	goal->prog.n = 0;
+
+	ret = compile_expr(&c, 0);
+	if (NOT_OK(ret))
+		goto error;
+
+	if (!is_flag_set(goal->params[c.pos], GOAL_TAIL_BIT)) {
+		ret = E_MSG("goal has more than one expression");
+		goto error;
+	}
+
+	ret = compile_margin(&c, goal);
+	if (NOT_OK(ret))
+		goto error;
+
+	goal->attrs = c.attrs;
+	goal->gain = margin_gain(goal, n_attrs);
+	return OK;
+
+error:
+	goal->prog.n = 0;
+	goal->margin.n = 0;
+	return ret;
+}
+
+/**
+ * Run a compiled goal against a set of attribute counts
+ */
+int32_t goal_eval(const struct goal_t *goal, const uint32_t *attr_n) {
+	return run_program(&goal->prog, attr_n);
+}
+
+/**
+ * How far a goal is from being met, with goals that are not a comparison counted
+ * as 0 when met and -1 otherwise
+ */
+int32_t goal_margin(const struct goal_t *goal, const uint32_t *attr_n) {
+	if (goal->margin.n)
+		return run_program(&goal->margin, attr_n);
+	return goal_eval(goal, attr_n) ? 0 : -1;
+}
+
+/**
+ * The fewest acceptances that could bring a goal's margin up to zero, or
+ * GOAL_NEED_NEVER if accepting more cannot help
+ */
+int32_t goal_need(const struct goal_t *goal, int32_t margin) {
+	if (margin >= 0)
+		return 0;
+	if (goal->gain <= 0)
+		return GOAL_NEED_NEVER;
+	return (goal->gain - 1 - margin) / goal->gain;
+}
+
+void reset_goal_margins(struct game_t *game) {
+	for (size_t i = 0; i < game->params->n_goals; ++i)
+		game->goal_margin[i] = goal_margin(&game->params->goals[i], game->attr_n);
+}
+
+/**
+ * Refresh the margins of just the goals that depend on one of attr, after a patron
+ * with those attributes has been accepted
+ */
+void update_goal_margins(struct game_t *game, uint8_t attr) {
+	for (size_t i = 0; i < game->params->n_goals; ++i) {
+		struct goal_t *goal = &game->params->goals[i];
+
+		if (goal->attrs & attr)
+			game->goal_margin[i] = goal_margin(goal, game->attr_n);
+	}
+}
+
+void get_goal_state(struct game_t *game, size_t i, struct goal_state *out) {
+	int32_t seats = 0;
+
+	if (game->accepted < ACCEPTED_LIMIT)
+		seats = ACCEPTED_LIMIT - (int32_t) game->accepted;
+
+	out->value = game->goal_margin[i];
+	out->need = goal_need(&game->params->goals[i], out->value);
+	out->slack = out->need == GOAL_NEED_NEVER ? -1 : seats - out->need;
+}
+
+/**
+ * Range of values an expression can take
+ */
+struct goal_bounds {
+	int32_t lo;
+	int32_t hi;
+};
+
+/**
+ * Bounds on a op b. Every operator is monotone in each operand on its own when the
+ * divisor does not straddle zero, so its extremes are at the corners.
+ */
+static struct goal_bounds bound_op(uint8_t op, struct goal_bounds a, struct goal_bounds b) {
+	struct goal_bounds res;
+	int32_t corners[4];
+	int32_t most;
+
+	// Dividing by zero gives zero, and by anything else shrinks the magnitude
+	if (op == GOAL_OP_DIV && b.lo <= 0 && b.hi >= 0) {
+		most = a.hi > -a.lo ? a.hi : -a.lo;
+		res.lo = b.lo == 0 && b.hi == 0 ? 0 : -most;
+		res.hi = b.lo == 0 && b.hi == 0 ? 0 : most;
+		return res;
+	}
+
+	corners[0] = apply_op(op, a.lo, b.lo);
+	corners[1] = apply_op(op, a.lo, b.hi);
+	corners[2] = apply_op(op, a.hi, b.lo);
+	corners[3] = apply_op(op, a.hi, b.hi);
+
+	res.lo = corners[0];
+	res.hi = corners[0];
+	for (size_t i = 1; i < 4; ++i) {
+		if (corners[i] < res.lo)
+			res.lo = corners[i];
+		if (corners[i] > res.hi)
+			res.hi = corners[i];
+	}
+
+	return res;
+}
+
+/**
+ * Interval version of run_program(), over attribute counts within bounds
+ */
+static struct goal_bounds bound_program(const struct goal_program *prog,
+	const struct goal_bounds *attr)
+{
+	struct goal_bounds stack[GOAL_STACK_MAX];
+	size_t j = 0;
+
+	for (size_t i = 0; i < prog->n; ++i) {
+		const struct goal_insn *insn = &prog->insn[i];
+
+		switch (insn->op) {
+		case GOAL_OP_CONST:
+			stack[j].lo = insn->arg;
+			stack[j].hi = insn->arg;
 			j += 1;
-			i += 1;
-		}
-		else {
-			has_input = false;
+			break;
+		case GOAL_OP_ATTR:
+			stack[j++] = attr[insn->arg];
+			break;
+		default:
+			stack[j-2] = bound_op(insn->op, stack[j-2], stack[j-1]);
+			j -= 1;
+			break;
 		}
 	}
 
-	return compute[0];
+	return stack[0];
+}
+
+/**
+ * Bounds on a goal's margin, with goals that are not a comparison mapped to 0 when
+ * met and -1 otherwise as in goal_margin()
+ */
+static struct goal_bounds bound_margin(const struct goal_t *goal,
+	const struct goal_bounds *attr)
+{
+	struct goal_bounds value;
+
+	if (goal->margin.n)
+		return bound_program(&goal->margin, attr);
+
+	value = bound_program(&goal->prog, attr);
+	if (value.lo == 0 && value.hi == 0)
+		return (struct goal_bounds) { -1, -1 };
+	if (value.lo > 0 || value.hi < 0)
+		return (struct goal_bounds) { 0, 0 };
+	return (struct goal_bounds) { -1, 0 };
+}
+
+/**
+ * Check whether the goals are settled for every way the game could go on. Each
+ * attribute count can rise by at most the number of patrons that can still be
+ * accepted, and treating the counts independently only widens the bounds, so a
+ * verdict other than GOALS_OPEN always holds.
+ */
+enum goals_outlook goals_outlook(struct game_t *game) {
+	struct goal_bounds attr[MAX_ATTRS];
+	struct goal_bounds margin;
+	uint32_t seats = 0;
+	bool met = true;
+
+	if (game->accepted < ACCEPTED_LIMIT && game->count < LOSS_LIMIT) {
+		seats = ACCEPTED_LIMIT - game->accepted;
+		if (LOSS_LIMIT - game->count < seats)
+			seats = LOSS_LIMIT - game->count;
+	}
+
+	for (size_t i = 0; i < MAX_ATTRS; ++i) {
+		attr[i].lo = (int32_t) game->attr_n[i];
+		attr[i].hi = (int32_t) (game->attr_n[i] + seats);
+	}
+
+	for (size_t i = 0; i < game->params->n_goals; ++i) {
+		margin = bound_margin(&game->params->goals[i], attr);
+		if (margin.hi < 0)
+			return GOALS_FAILED;
+		if (margin.lo < 0)
+			met = false;
+	}
+
+	return met ? GOALS_MET : GOALS_OPEN;
 }
 
 static bool check_goal(struct game_t *game, size_t i) {
 	struct goal_t *goal = &game->params->goals[i];
-	return goal_param(game, goal) != 0;
+	return goal_eval(goal, game->attr_n) != 0;
 }
 
 bool check_goals(struct game_t *game) {
@@ -100,6 +443,116 @@ DEFINE_BASIC_TEST(goal_param_calc, {
 			GOAL_VALUE(13)
 		)
 	};
+	struct goal_t g2 = {
+		.params = GOAL_PARAMS(
+			GOAL_OPER_GE,
+			GOAL_OPER_DIV,
+			GOAL_ATTR(1),
+			GOAL_ATTR(0),
+			GOAL_VALUE(3)
+		)
+	};
+	uint32_t attr_n[2] = {0, 7};
+
+	TEST_EQUALS(compile_goal(&g1, 0), OK);
+	TEST_EQUALS(goal_eval(&g1, NULL), 10);
+	// Constants are folded away
+	TEST_EQUALS(g1.prog.n, 1);
+
+	TEST_EQUALS(compile_goal(&g2, 2), OK);
+	TEST_EQUALS(g2.prog.n, 5);
+	TEST_EQUALS(goal_eval(&g2, attr_n), 0);
+	attr_n[0] = 2;
+	TEST_EQUALS(goal_eval(&g2, attr_n), 1);
+});
+
+DEFINE_BASIC_TEST(goal_compile_checks, {
+	struct goal_t missing = { .params = GOAL_PARAMS(GOAL_OPER_PLUS, GOAL_VALUE(1)) };
+	struct goal_t extra = { .params = GOAL_PARAMS(GOAL_VALUE(1), GOAL_VALUE(2)) };
+	struct goal_t oper = { .params = GOAL_PARAMS(GOAL_OPER_BIT | 6, GOAL_VALUE(1), GOAL_VALUE(2)) };
+	struct goal_t attr = { .params = GOAL_PARAMS(GOAL_OPER_PLUS, GOAL_ATTR(2), GOAL_VALUE(1)) };
+	struct goal_t zero = {
+		.params = GOAL_PARAMS(
+			GOAL_OPER_DIV,
+			GOAL_ATTR(0),
+			GOAL_OPER_MINUS,
+			GOAL_VALUE(2),
+			GOAL_VALUE(2)
+		)
+	};
+	uint32_t deep[2*GOAL_STACK_MAX+2];
+	struct goal_t depth = { .params = deep };
+	size_t i;
+
+	// Right nested so every operand is still on the stack at the innermost one
+	for (i = 0; i < GOAL_STACK_MAX; ++i) {
+		deep[2*i] = GOAL_OPER_PLUS;
+		deep[2*i+1] = GOAL_ATTR(0);
+	}
+	deep[2*i] = GOAL_ATTR(0);
+	deep[2*i+1] = GOAL_TAIL;
+
+	TEST_EQUALS(NOT_OK(compile_goal(&missing, 2)), true);
+	TEST_EQUALS(NOT_OK(compile_goal(&extra, 2)), true);
+	TEST_EQUALS(NOT_OK(compile_goal(&oper, 2)), true);
+	TEST_EQUALS(NOT_OK(compile_goal(&attr, 2)), true);
+	TEST_EQUALS(NOT_OK(compile_goal(&zero, 2)), true);
+	TEST_EQUALS(NOT_OK(compile_goal(&depth, 2)), true);
+	TEST_EQUALS(attr.prog.n, 0);
+});
+
+DEFINE_BASIC_TEST(goal_margin_need, {
+	struct goal_t ge = {
+		.params = GOAL_PARAMS(
+			GOAL_OPER_GE,
+			GOAL_ATTR(1),
+			GOAL_OPER_DIV,
+			GOAL_ATTR(0),
+			GOAL_VALUE(2)
+		)
+	};
+	struct goal_t lt = { .params = GOAL_PARAMS(GOAL_OPER_LT, GOAL_ATTR(0), GOAL_VALUE(5)) };
+	uint32_t attr_n[2] = {10, 2};
+
+	TEST_EQUALS(compile_goal(&ge, 2), OK);
+	TEST_EQUALS(ge.attrs, 3);
+	TEST_EQUALS(ge.gain, 1);
+	TEST_EQUALS(goal_margin(&ge, attr_n), -3);
+	TEST_EQUALS(goal_need(&ge, -3), 3);
+	TEST_EQUALS(goal_need(&ge, 2), 0);
+
+	TEST_EQUALS(compile_goal(&lt, 2), OK);
+	TEST_EQUALS(lt.attrs, 1);
+	TEST_EQUALS(lt.gain, 0);
+	attr_n[0] = 3;
+	TEST_EQUALS(goal_margin(&lt, attr_n), 1);
+	attr_n[0] = 5;
+	TEST_EQUALS(goal_margin(&lt, attr_n), -1);
+	TEST_EQUALS(goal_need(&lt, -1), GOAL_NEED_NEVER);
+});
+
+DEFINE_BASIC_TEST(goals_outlook_bounds, {
+	struct goal_t goals[1] = {
+		{ .params = GOAL_PARAMS(GOAL_OPER_GE, GOAL_ATTR(0), GOAL_VALUE(600)) }
+	};
+	struct game_params_t params = { .n_goals = 1, .goals = goals };
+	struct game_t game = { .params = &params };
+
+	TEST_EQUALS(compile_goal(&goals[0], 2), OK);
+
+	// Exactly enough seats left is still open
+	game.accepted = 500;
+	game.attr_n[0] = 100;
+	TEST_EQUALS(goals_outlook(&game), GOALS_OPEN);
+
+	game.attr_n[0] = 99;
+	TEST_EQUALS(goals_outlook(&game), GOALS_FAILED);
+
+	// Too few patrons left before the loss limit
+	game.attr_n[0] = 100;
+	game.count = LOSS_LIMIT - 499;
+	TEST_EQUALS(goals_outlook(&game), GOALS_FAILED);
 
-	TEST_EQUALS(goal_param(NULL, &g1), 10);
+	game.attr_n[0] = 600;
+	TEST_EQUALS(goals_outlook(&game), GOALS_MET);
 });
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <libgjm/errors.h>
 #include <libgjm/util.h>
 
 // Goal parameters are a packed field with bits indicating the attr type
@@ -26,12 +27,82 @@
 
 #define GOAL_PARAMS(...) (uint32_t[]) { __VA_ARGS__, GOAL_TAIL }
 
+// Limits on compiled goals, anything that would exceed them is rejected
+#define GOAL_PROGRAM_MAX 64
+#define GOAL_STACK_MAX 16
+
 struct game_t;
 
+enum goal_opcode {
+	GOAL_OP_CONST,
+	GOAL_OP_ATTR,
+	// Binary operators, in the same order as the GOAL_OPER_ values
+	GOAL_OP_PLUS,
+	GOAL_OP_MINUS,
+	GOAL_OP_DIV,
+	GOAL_OP_MULT,
+	GOAL_OP_LT,
+	GOAL_OP_GE,
+};
+
+struct goal_insn {
+	uint8_t op;
+	int32_t arg;
+};
+
+/**
+ * A goal compiled to postfix. Everything that could go wrong is checked when it is
+ * compiled, so running it needs no checks beyond dividing by an attribute count of
+ * zero, which gives zero.
+ */
+struct goal_program {
+	size_t n;
+	struct goal_insn insn[GOAL_PROGRAM_MAX];
+};
+
 struct goal_t {
 	uint32_t *params;
+	struct goal_program prog;
+
+	// How far the goal is from being met, as lhs - rhs of its comparison, and the
+	// most that accepting one patron can add to that
+	struct goal_program margin;
+	int32_t gain;
+	// Attributes the goal depends on
+	uint8_t attrs;
+};
+
+// need for a goal that no number of acceptances can meet
+#define GOAL_NEED_NEVER -1
+
+/**
+ * Where a goal stands in a game. The value is its margin, met once it is not
+ * negative, need is the fewest more acceptances that could meet it, and slack is
+ * how many seats are left over after that, negative if it can no longer be met.
+ */
+struct goal_state {
+	int32_t value;
+	int32_t need;
+	int32_t slack;
+};
+
+/**
+ * Whether a game's goals are already decided however the rest of it goes
+ */
+enum goals_outlook {
+	GOALS_OPEN,
+	GOALS_FAILED,
+	GOALS_MET,
 };
 
+error_t *compile_goal(struct goal_t *goal, size_t n_attrs);
+int32_t goal_eval(const struct goal_t *goal, const uint32_t *attr_n);
+int32_t goal_margin(const struct goal_t *goal, const uint32_t *attr_n);
+int32_t goal_need(const struct goal_t *goal, int32_t margin);
+void reset_goal_margins(struct game_t *game);
+void update_goal_margins(struct game_t *game, uint8_t attr);
+void get_goal_state(struct game_t *game, size_t i, struct goal_state *out);
+enum goals_outlook goals_outlook(struct game_t *game);
 bool check_goals(struct game_t *game);
 
 #endif
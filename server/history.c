@@ -0,0 +1,156 @@
+#include <string.h>
+
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "game.h"
+#include "history.h"
+
+/**
+ * Stored histories pack each patron into HISTORY_WIDTH(n) bits at <uuid>-h, with
+ * the attributes in the low n bits and the accept bit above them. Entry i starts
+ * at bit i*width counting from the most significant bit of the first byte, which is
+ * the layout BITFIELD uses, so BITFIELD GET u<width> #i reads a single patron. For
+ * the two attribute games this is 3 bits rather than a byte. Seeded games store no
+ * attributes at all, which is n = 0 and a single bit per patron.
+ */
+static uint32_t encode(uint8_t attr, size_t n_attrs) {
+	uint32_t val = attr & (BIT(n_attrs) - 1);
+
+	if (is_flag_set(attr, BIT_ATTR_ACCEPT))
+		val |= BIT(n_attrs);
+	return val;
+}
+
+static uint8_t decode(uint32_t val, size_t n_attrs) {
+	uint8_t attr = val & (BIT(n_attrs) - 1);
+
+	if (is_flag_set(val, BIT(n_attrs)))
+		attr |= BIT_ATTR_ACCEPT;
+	return attr;
+}
+
+/**
+ * Pack the patrons from start to end, for writing over the stored history from
+ * byte *offset onwards. Entries before start that share that first byte come from
+ * seen as well, so the whole byte can be written. Returns the number of bytes.
+ */
+size_t history_pack(uint8_t *out, const uint8_t *seen, uint32_t start, uint32_t end,
+	size_t n_attrs, size_t *offset)
+{
+	size_t width = HISTORY_WIDTH(n_attrs);
+	size_t first_bit = (start * width / 8) * 8;
+	size_t len = HISTORY_BYTES(end, width) - first_bit / 8;
+
+	memset(out, 0, len);
+
+	for (uint32_t i = first_bit / width; i < end; ++i) {
+		uint32_t val = encode(seen[i], n_attrs);
+
+		for (size_t b = 0; b < width; ++b) {
+			size_t pos = i * width + b;
+
+			if (pos < first_bit || !is_flag_set(val, BIT(width - 1 - b)))
+				continue;
+
+			pos -= first_bit;
+			out[pos / 8] |= 0x80 >> (pos % 8);
+		}
+	}
+
+	*offset = first_bit / 8;
+	return len;
+}
+
+/**
+ * Read the patron at index i of a packed history
+ */
+uint8_t history_get(const uint8_t *packed, uint32_t i, size_t n_attrs) {
+	size_t width = HISTORY_WIDTH(n_attrs);
+	uint32_t val = 0;
+
+	for (size_t b = 0; b < width; ++b) {
+		size_t pos = i * width + b;
+
+		val = (val << 1) | ((packed[pos / 8] >> (7 - pos % 8)) & 1);
+	}
+
+	return decode(val, n_attrs);
+}
+
+void history_unpack(uint8_t *seen, const uint8_t *packed, uint32_t count,
+	size_t n_attrs)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		seen[i] = history_get(packed, i, n_attrs);
+}
+
+DEFINE_BASIC_TEST(history_pack_append, {
+	uint8_t seen[11] = {0, 1 | BIT_ATTR_ACCEPT, 3, 2, BIT_ATTR_ACCEPT, 1, 0,
+		3 | BIT_ATTR_ACCEPT, 2, 0, 1};
+	uint8_t stored[HISTORY_BYTES(11, 3)] = {0};
+	uint8_t chunk[sizeof(stored)];
+	uint8_t out[11];
+	size_t offset;
+	size_t len;
+
+	// Written in two appends, the second starting partway through a byte
+	len = history_pack(chunk, seen, 0, 5, 2, &offset);
+	TEST_EQUALS(offset, 0);
+	TEST_EQUALS(len, 2);
+	memcpy(stored + offset, chunk, len);
+
+	len = history_pack(chunk, seen, 5, 11, 2, &offset);
+	TEST_EQUALS(offset, 1);
+	TEST_EQUALS(offset + len, sizeof(stored));
+	memcpy(stored + offset, chunk, len);
+
+	// Entry 1 is 0b101 and entry 2 is 0b011
+	TEST_EQUALS(stored[0], 0x15);
+	TEST_EQUALS(history_get(stored, 7, 2), 3 | BIT_ATTR_ACCEPT);
+
+	history_unpack(out, stored, 11, 2);
+	TEST_EQUALS(memcmp(out, seen, sizeof(seen)), 0);
+
+	// Without attributes only the accept bits are kept
+	len = history_pack(chunk, seen, 0, 11, 0, &offset);
+	TEST_EQUALS(len, 2);
+	TEST_EQUALS(chunk[0], 0x49);
+	TEST_EQUALS(chunk[1], 0);
+	TEST_EQUALS(history_get(chunk, 7, 0), BIT_ATTR_ACCEPT);
+	TEST_EQUALS(history_get(chunk, 8, 0), 0);
+});
+
+DEFINE_BASIC_TEST(history_seeded_roundtrip, {
+	struct game_params_t params = { .rng_params = { .n = 2 } };
+	uint64_t seed = 0x0123456789abcdefULL;
+	uint8_t seen[40];
+	uint8_t stored[HISTORY_BYTES(40, HISTORY_WIDTH(0))];
+	uint8_t out[40];
+	size_t offset;
+	size_t len;
+
+	// Half of each column goes to the next one, so every combination can appear
+	for (uint32_t c = 0; c < BIT(2); ++c) {
+		params.dist_params.alias_prob[c] = BIT(31);
+		params.dist_params.alias[c] = (c + 1) % BIT(2);
+	}
+
+	for (uint32_t i = 0; i < 40; ++i) {
+		seen[i] = generate_person_at(&params, seed, i);
+		if (i % 3 == 0)
+			seen[i] |= BIT_ATTR_ACCEPT;
+	}
+
+	len = history_pack(stored, seen, 0, 40, 0, &offset);
+	TEST_EQUALS(offset, 0);
+	TEST_EQUALS(len, sizeof(stored));
+
+	history_unpack(out, stored, 40, 0);
+	for (uint32_t i = 0; i < 40; ++i)
+		out[i] |= generate_person_at(&params, seed, i);
+	TEST_EQUALS(memcmp(out, seen, sizeof(seen)), 0);
+
+	TEST_EQUALS(generate_person_at(&params, seed, 17),
+		generate_person_at(&params, seed, 17));
+});
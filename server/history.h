@@ -0,0 +1,23 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Formats of the stored history, kept in the game hash as history. Games without
+// one still have the original one byte per patron string at <uuid>-m.
+#define HISTORY_PACKED 1
+// Only the accept bits are stored, as the patrons can be drawn again from the seed
+#define HISTORY_SEEDED 2
+
+// Each patron takes their attribute bits and an accept bit
+#define HISTORY_WIDTH(n_attrs) ((n_attrs) + 1)
+#define HISTORY_BYTES(count, width) (((size_t) (count) * (width) + 7) / 8)
+
+size_t history_pack(uint8_t *out, const uint8_t *seen, uint32_t start, uint32_t end,
+	size_t n_attrs, size_t *offset);
+void history_unpack(uint8_t *seen, const uint8_t *packed, uint32_t count,
+	size_t n_attrs);
+uint8_t history_get(const uint8_t *packed, uint32_t i, size_t n_attrs);
+
+#endif
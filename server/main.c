@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
@@ -7,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
@@ -17,19 +19,82 @@
 #include <libgjm/test.h>
 #include <libgjm/util.h>
 
+#include "async.h"
 #include "goal.h"
 #include "game.h"
+#include "proto.h"
+#include "recent.h"
+#include "stream.h"
+#include "symbols.h"
 #include "valkey.h"
 
 #define GAME_PORT 8124
 
-struct MHD_Response *web_reply_json(char *msg) {
+// Seconds that clients may reuse a /params reply before checking its ETag
+#define PARAMS_MAX_AGE 3600
+
+// Room for the goals array in a game reply, at most 40 bytes for each goal
+#define GOALS_JSON_LEN (16 + 40*MAX_GOALS)
+
+/**
+ * How MHD runs requests:
+ * - select: one internal thread polls every connection and runs every request
+ * - conn: a thread per connection, plus the thread accepting them
+ * - pool: a pool of threads, each with its own epoll set of connections
+ * - async: one event loop shared with an async valkey connection, where
+ *   /new-game and /process-person suspend instead of blocking
+ */
+enum server_mode {
+	MODE_SELECT,
+	MODE_CONN,
+	MODE_POOL,
+	MODE_ASYNC,
+};
+
+static const char *mode_names[] = {
+	[MODE_SELECT] = "select",
+	[MODE_CONN] = "conn",
+	[MODE_POOL] = "pool",
+	[MODE_ASYNC] = "async",
+};
+
+struct server_cfg {
+	enum server_mode mode;
+	// Threads in pool mode, 0 for one per cpu
+	unsigned int threads;
+	// Connection limit and idle timeout in seconds, 0 for the MHD defaults
+	unsigned int conn_limit;
+	unsigned int conn_timeout;
+	bool keep_alive;
+};
+
+static struct server_cfg cfg = {
+	.mode = MODE_SELECT,
+	.keep_alive = true,
+};
+
+struct MHD_Response *web_reply(const void *buf, size_t len,
+	enum MHD_ResponseMemoryMode mode, const char *type)
+{
 	struct MHD_Response *reply;
-	reply = MHD_create_response_from_buffer(strlen(msg), msg, MHD_RESPMEM_MUST_COPY);
-	MHD_add_response_header(reply, "Content-Type", "application/json");
+	reply = MHD_create_response_from_buffer(len, (void *) buf, mode);
+	MHD_add_response_header(reply, "Content-Type", type);
+	if (!cfg.keep_alive)
+		MHD_add_response_header(reply, "Connection", "close");
 	return reply;
 }
 
+struct MHD_Response *web_reply_json(char *msg) {
+	return web_reply(msg, strlen(msg), MHD_RESPMEM_MUST_COPY, "application/json");
+}
+
+/**
+ * A binary reply for the /bin/ routes, see proto.h
+ */
+struct MHD_Response *web_reply_bin(const uint8_t *buf, size_t len) {
+	return web_reply(buf, len, MHD_RESPMEM_MUST_COPY, BIN_CONTENT_TYPE);
+}
+
 enum MHD_Result web_bad_arg(struct MHD_Connection *conn, const char *name) {
 	char msg[128];
 
@@ -88,7 +153,7 @@ enum MHD_Result web_new_user(struct MHD_Connection *conn) {
 	struct MHD_Response *resp;
 	uuid_t uuid;
 	struct valkey_t *vk;
-	struct valkeyReply *reply;
+	struct valkey_batch batch;
 	error_t *ret;
 	char msg[128];
 	struct user_t user = {0};
@@ -110,122 +175,219 @@ enum MHD_Result web_new_user(struct MHD_Connection *conn) {
 			return web_bad_arg(conn, "name");
 	}
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "HGET usernames %s", user.realname);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		ret = E_VALKEY(vk->ctx, reply);
-		goto fail_valkey;
-	}
+	uuid_generate(uuid);
+	uuid_unparse(uuid, user.name);
 
-	if (reply->type != VALKEY_REPLY_NIL) {
-		ret = E_MSG("username taken");
-		goto fail_msg;
-	}
+	// Claiming the name with HSETNX is also the check that it is free, and the id
+	// is allocated alongside it. An id is wasted if the name is taken but that is
+	// harmless
+	vk = get_valkey();
+	if (!vk)
+		return web_send_error(conn, E_VALKEY_BUSY);
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "INCR next_user");
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+	valkey_batch_init(&batch, vk);
+	valkey_batch_add(&batch, "HSETNX usernames %s %s", user.realname, user.name);
+	valkey_batch_add(&batch, "INCR next_user");
 
-	user.id = reply->integer;
-	uuid_generate(uuid);
-	uuid_unparse(uuid, user.name);
+	ret = valkey_batch_run(&batch);
+	if (NOT_OK(ret))
+		goto failure;
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "HSETNX usernames %s %s", user.realname, user.name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		ret = E_VALKEY(vk->ctx, reply);
-		goto fail_valkey;
+	if (batch.replies[0]->integer == 0) {
+		ret = E_MSG("username taken");
+		goto failure;
 	}
 
+	user.id = batch.replies[1]->integer;
 	DEBUG("initialized new user %s (%s) id %u\n", user.name, user.realname, user.id);
 
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "HSET userids %d %s", user.id, user.name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
-
-	freeReplyObject(reply);
-	reply = valkeyCommand(vk->ctx, "HSET %s id %d name %s", user.name, user.id,
+	valkey_batch_free(&batch);
+	valkey_batch_add(&batch, "HSET userids %d %s", user.id, user.name);
+	valkey_batch_add(&batch, "HSET %s id %d name %s", user.name, user.id,
 		user.realname);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR)
-		goto fail_valkey;
+
+	ret = valkey_batch_run(&batch);
+	if (NOT_OK(ret))
+		goto failure;
 
 	snprintf(msg, sizeof(msg), "{\"uuid\":\"%s\"}", user.name);
 	resp = web_reply_json(msg);
 	web_set_cookie(resp, "userid", user.name);
 	web_set_cookie(resp, "userdisplay", user.realname);
 
-	freeReplyObject(reply);
+	valkey_batch_free(&batch);
 	release_valkey(vk);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
 
-fail_valkey:
-	ret = E_VALKEY(vk->ctx, reply);
-fail_msg:
-	freeReplyObject(reply);
+failure:
+	valkey_batch_free(&batch);
 	release_valkey(vk);
 	return web_send_error(conn, ret);
 }
 
-enum MHD_Result web_new_game(struct MHD_Connection *conn) {
-	uuid_t userid;
+/**
+ * Read the arguments of /new-game, returning the name of a bad one or NULL
+ */
+static const char *new_game_args(struct MHD_Connection *conn, uuid_t userid, int *type,
+	bool *has_seed, uint64_t *seed)
+{
 	const char *user_arg;
 	const char *type_arg;
-	int type;
-	error_t *ret;
-	struct MHD_Response *resp;
-	struct game_t game = {0};
-	struct user_t user = {0};
-	char msg[128];
+	const char *seed_arg;
+	char *end;
 
 	user_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "user");
 	if (!user_arg || uuid_parse(user_arg, userid) < 0)
-		return web_bad_arg(conn, "user");
+		return "user";
 
 	type_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "type");
 	if (!type_arg)
-		return web_bad_arg(conn, "type");
+		return "type";
+
+	*type = atoi(type_arg);
+	if (!valid_game_type((size_t) *type))
+		return "type";
+
+	// A seed replays the same patrons as any other game with that seed
+	seed_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "seed");
+	*has_seed = seed_arg != NULL;
+	if (seed_arg) {
+		if (!isdigit(seed_arg[0]))
+			return "seed";
+
+		errno = 0;
+		*seed = strtoull(seed_arg, &end, 10);
+		if (errno || *end)
+			return "seed";
+	}
 
-	type = atoi(type_arg);
-	if (!valid_game_type((size_t) type))
-		return web_bad_arg(conn, "type");
+	return NULL;
+}
+
+struct MHD_Response *web_reply_new_game(struct game_t *game, bool has_seed) {
+	char msg[128];
+
+	DEBUG("new game %s, type %d\n", game->name, game->type);
+	// The seed is only repeated back when the client chose it, since knowing it
+	// means knowing every patron to come
+	if (has_seed)
+		snprintf(msg, sizeof(msg), "{\"id\":\"%s\",\"seed\":\"%llu\"}", game->name,
+			(unsigned long long) game->seed);
+	else
+		snprintf(msg, sizeof(msg), "{\"id\":\"%s\"}", game->name);
+
+	return web_reply_json(msg);
+}
+
+enum MHD_Result web_new_game(struct MHD_Connection *conn) {
+	uuid_t userid;
+	const char *bad;
+	bool has_seed;
+	uint64_t seed;
+	int type;
+	error_t *ret;
+	bool found;
+	struct MHD_Response *resp;
+	struct game_t game = {0};
+	struct user_t user = {0};
+
+	bad = new_game_args(conn, userid, &type, &has_seed, &seed);
+	if (bad)
+		return web_bad_arg(conn, bad);
 
 	// Require uuid so that you cannot start games as someone else
-	if (!find_user(userid, &user)) {
-		DEBUG("could not find user for (valid) uuid %s\n", user_arg);
+	ret = find_user(userid, &user, &found);
+	if (NOT_OK(ret))
+		return web_send_error(conn, ret);
+
+	if (!found) {
+		DEBUG("could not find user for (valid) uuid %s\n", user.name);
 		return web_bad_arg(conn, "user");
 	}
 
-	ret = new_game(type, &user, &game);
+	ret = new_game(type, &user, has_seed ? &seed : NULL, &game);
 	if (NOT_OK(ret))
 		return web_send_error(conn, ret);
 
-	DEBUG("new game %s, type %u\n", game.name, type);
-	snprintf(msg, sizeof(msg), "{\"id\":\"%s\"}", game.name);
+	resp = web_reply_new_game(&game, has_seed);
 	release_game(&game);
-
-	resp = web_reply_json(msg);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
 }
 
+/**
+ * Write where each goal stands, to be appended to a game object so that clients
+ * need not track the goals themselves. Returns the length as snprintf() does.
+ */
+size_t format_goals(char *buf, size_t len, struct game_t *game) {
+	struct goal_state state;
+	size_t off;
+
+	off = snprintf(buf, len, ",\"goals\":[");
+	for (size_t i = 0; i < game->params->n_goals && off < len; ++i) {
+		get_goal_state(game, i, &state);
+		off += snprintf(buf + off, len - off,
+			"%s{\"value\":%d,\"need\":%d,\"slack\":%d}", i ? "," : "",
+			state.value, state.need, state.slack);
+	}
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "]");
+	return off;
+}
+
 void format_game(char *buf, size_t len, struct game_t *game) {
 	const char *status = "running";
+	size_t off;
 
 	if (game_is_finished(game)) {
 		if (game->goals_satisfied)
 			status = "completed";
 		else
 			status = "failed";
-		snprintf(buf, len, "{\"status\":\"%s\",\"count\":%d}", status, game->count);
+		off = snprintf(buf, len, "{\"status\":\"%s\",\"count\":%d", status,
+			game->count);
 	}
 	else {
-		snprintf(buf, len, "{\"status\":\"%s\",\"count\":%d,\"next\":%d}",
+		off = snprintf(buf, len, "{\"status\":\"%s\",\"count\":%d,\"next\":%d",
 			status, game->count, game->next);
 	}
+
+	if (off < len)
+		off += format_goals(buf + off, len - off, game);
+	if (off < len)
+		snprintf(buf + off, len - off, "}");
+}
+
+void format_game_bin(uint8_t buf[BIN_GAME_LEN], struct game_t *game) {
+	buf[0] = BIN_RUNNING;
+	buf[1] = game->next;
+
+	if (game_is_finished(game)) {
+		buf[0] = game->goals_satisfied ? BIN_COMPLETED : BIN_FAILED;
+		buf[1] = 0;
+	}
+
+	bin_put_u16(buf + 2, 0);
+	bin_put_u32(buf + 4, game->count);
+}
+
+/**
+ * Reply with where a game stands, as JSON or in the BIN_GAME_LEN layout
+ */
+struct MHD_Response *web_reply_game(struct game_t *game, bool bin) {
+	uint8_t frame[BIN_GAME_LEN];
+	char msg[128 + GOALS_JSON_LEN];
+
+	if (bin) {
+		format_game_bin(frame, game);
+		return web_reply_bin(frame, sizeof(frame));
+	}
+
+	format_game(msg, sizeof(msg), game);
+	return web_reply_json(msg);
 }
 
-enum MHD_Result web_process_person(struct MHD_Connection *conn) {
+enum MHD_Result web_process_person(struct MHD_Connection *conn, bool bin) {
 	uuid_t gameid;
 	bool verdict = false;
 	int person;
@@ -234,7 +396,6 @@ enum MHD_Result web_process_person(struct MHD_Connection *conn) {
 	const char *person_arg;
 	struct MHD_Response *resp;
 	error_t *ret;
-	char msg[128];
 	struct game_t game = {0};
 
 	game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
@@ -269,15 +430,8 @@ enum MHD_Result web_process_person(struct MHD_Connection *conn) {
 	if (NOT_OK(ret))
 		goto handle_error;
 
-	if (!game_is_finished(&game)) {
-		ret = create_next_person(&game);
-		if (NOT_OK(ret))
-			goto handle_error;
-	}
-
 send_reply:
-	format_game(msg, sizeof(msg), &game);
-	resp = web_reply_json(msg);
+	resp = web_reply_game(&game, bin);
 	release_game(&game);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
 
@@ -286,236 +440,783 @@ handle_error:
 	return web_send_error(conn, ret);
 }
 
-enum MHD_Result web_process_game_details(struct MHD_Connection *conn) {
+/**
+ * Parse a policy given as hex, most significant digit first like any other number,
+ * so bit c of the value is whether to accept attribute combination c
+ */
+bool parse_policy(const char *str, uint64_t policy[POLICY_WORDS]) {
+	size_t len = strlen(str);
+
+	memset(policy, 0, POLICY_WORDS * sizeof(*policy));
+	if (len == 0 || len > POLICY_WORDS * 16)
+		return false;
+
+	for (size_t i = 0; i < len; ++i) {
+		char ch = str[len - 1 - i];
+		uint64_t digit;
+
+		if (!isxdigit(ch))
+			return false;
+
+		digit = isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+		policy[i / 16] |= digit << (4 * (i % 16));
+	}
+
+	return true;
+}
+
+/**
+ * Decide up to k patrons, starting with the pending one, using an accept policy
+ * committed to before any of them are seen. The reply is the game state as for
+ * /process-person plus every patron decided, with the accept bit set on those
+ * that were let in.
+ */
+enum MHD_Result web_process_policy(struct MHD_Connection *conn) {
+	uuid_t gameid;
+	int person;
+	long k;
+	uint32_t start;
+	uint64_t policy[POLICY_WORDS];
 	const char *game_arg;
+	const char *person_arg;
+	const char *policy_arg;
+	const char *k_arg;
 	struct MHD_Response *resp;
 	struct ioport *iop;
 	error_t *ret;
-	char msg[256];
+	char *buf;
+	size_t buflen;
+	char msg[128 + GOALS_JSON_LEN];
 	struct game_t game = {0};
-	struct user_t user = {0};
 
 	game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
-	if (!game_arg)
+	if (!game_arg || uuid_parse(game_arg, gameid) < 0)
 		return web_bad_arg(conn, "game");
 
-	ret = find_game_string(game_arg, &game);
+	person_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "person");
+	if (!person_arg)
+		return web_bad_arg(conn, "person");
+
+	policy_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "policy");
+	if (!policy_arg || !parse_policy(policy_arg, policy))
+		return web_bad_arg(conn, "policy");
+
+	k_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "k");
+	if (!k_arg)
+		return web_bad_arg(conn, "k");
+
+	k = atol(k_arg);
+	if (k < 1 || k > LOSS_LIMIT)
+		return web_bad_arg(conn, "k");
+
+	ret = find_game(gameid, &game);
 	if (NOT_OK(ret)) {
 		error_free(ret);
+		DEBUG("could not find game for (valid) uuid %s\n", game_arg);
 		return web_bad_arg(conn, "game");
 	}
 
-	if (!find_user_by_id(game.userid, &user)) {
-		DEBUG("game userid: %d\n", game.userid);
-		release_game(&game);
-		return web_bad_arg(conn, "game");
+	person = atoi(person_arg);
+	if (person != (int) game.count) {
+		ret = E_MSG("wrong person");
+		goto handle_error;
 	}
 
-	iop = iop_alloc_fixstr(msg, sizeof(msg));
+	start = game.count;
+	ret = process_policy(&game, policy, (uint32_t) k);
+	if (NOT_OK(ret))
+		goto handle_error;
 
-	iop_printf(iop,
-		"{\"count\":%u,\"user\":\"%s\",\"accepted\":%u,\"next\":%u,\"attrs\":[",
-		game.count, user.realname, game.accepted, game.next);
-	for (size_t i = 0; i < MAX_ATTRS-1; ++i) {
-		iop_printf(iop, "%u,", game.attr_n[i]);
+	// Game state as for /process-person, then each symbol as up to 3 digits and
+	// a comma
+	buflen = sizeof(msg) + 4*(game.count - start);
+	buf = calloc(buflen, sizeof(*buf));
+	if (!buf) {
+		ret = E_NOMEM;
+		goto handle_error;
 	}
-	iop_printf(iop, "%u],\"type\":%d", game.attr_n[MAX_ATTRS-1], game.type);
 
-	if (game_is_finished(&game)) {
-		iop_printf(iop, ",\"finished\":true,\"won\":%s",
-			game.goals_satisfied ? "true" : "false");
+	format_game(msg, sizeof(msg), &game);
+	iop = iop_alloc_fixstr(buf, buflen);
+	if (!iop) {
+		free(buf);
+		ret = E_NOMEM;
+		goto handle_error;
 	}
 
-	iop_printf(iop, "}");
+	// Reopen the game object to append the decided symbols
+	iop_printf(iop, "%.*s,\"symbols\":[", (int) strlen(msg) - 1, msg);
+	for (uint32_t i = start; i < game.count; ++i) {
+		iop_printf(iop, "%s%d", i > start ? "," : "", game.seen[i]);
+	}
+	iop_printf(iop, "]}");
 
 	iop_free(iop);
 	release_game(&game);
 
-	resp = web_reply_json(msg);
+	resp = web_reply_json(buf);
+	free(buf);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+
+handle_error:
+	release_game(&game);
+	return web_send_error(conn, ret);
 }
 
-enum MHD_Result web_symbols(struct MHD_Connection *conn) {
+/**
+ * Switch the connection over to a binary session for one game, see stream.h. Only
+ * the game argument is needed since the session starts from wherever the game is.
+ */
+enum MHD_Result web_stream(struct MHD_Connection *conn) {
 	const char *game_arg;
+	const char *upgrade;
 	struct MHD_Response *resp;
-	struct ioport *iop;
-	char *msg;
-	size_t msglen;
-	size_t i;
-	error_t *ret;
-	struct game_t game = {0};
+	enum MHD_Result ret;
+	uuid_t gameid;
+
+	upgrade = MHD_lookup_connection_value(conn, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+	if (!upgrade || strcasecmp(upgrade, STREAM_PROTOCOL) != 0)
+		return web_send_error(conn, E_MSG("expected upgrade to " STREAM_PROTOCOL));
 
 	game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
-	if (!game_arg)
+	if (!game_arg || uuid_parse(game_arg, gameid) < 0)
 		return web_bad_arg(conn, "game");
 
-	ret = find_game_string(game_arg, &game);
-	if (NOT_OK(ret)) {
-		error_free(ret);
-		return web_bad_arg(conn, "game");
-	}
+	resp = stream_response(gameid);
+	if (!resp)
+		return web_send_error(conn, E_NOMEM);
 
-	// Approximate guess at buffer size, make it larger if there are failures
-	// Note that each symbol is a uint8_t currently so we need at most 3 digits
-	// plus a space (=4) for each one
-	msglen = 128 + 4*game.count;
-	msg = calloc(msglen, sizeof(*msg));
-	iop = iop_alloc_fixstr(msg, msglen);
+	ret = MHD_queue_response(conn, MHD_HTTP_SWITCHING_PROTOCOLS, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
 
-	iop_printf(iop, "{\"count\":%d,\"symbols\":[", game.count);
-	if (game.count > 0) {
-		for (i = 0; i < game.count-1; ++i) {
-			iop_printf(iop, "%d,", game.seen[i]);
-		}
-		iop_printf(iop, "%d]}", game.seen[game.count-1]);
-	}
-	else {
-		iop_printf(iop, "]}");
-	}
+/**
+ * What every request that suspends on the event loop keeps in the request pointer,
+ * first in its own state so that web_completed() can free any of them
+ */
+struct async_reply {
+	struct MHD_Connection *conn;
+
+	// Set once there is a reply, and whether the handler is still on the stack
+	// so the connection was never suspended
+	bool done;
+	bool in_handler;
+	// Argument to reply about instead, if it turned out to be bad
+	const char *bad_arg;
+	error_t *err;
+	struct MHD_Response *resp;
+};
 
-	resp = web_reply_json(msg);
-	free(msg);
-	iop_free(iop);
-	release_game(&game);
+static void async_reply_finish(struct async_reply *reply, error_t *err) {
+	reply->err = err;
+	reply->done = true;
+	if (!reply->in_handler)
+		MHD_resume_connection(reply->conn);
+}
 
-	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+/**
+ * Send the reply for a request that has finished, and free its state
+ */
+static enum MHD_Result async_reply_send(struct MHD_Connection *conn, void **state,
+	struct async_reply *reply)
+{
+	enum MHD_Result ret;
+
+	*state = NULL;
+	if (reply->bad_arg)
+		ret = web_bad_arg(conn, reply->bad_arg);
+	else if (NOT_OK(reply->err))
+		ret = web_send_error(conn, reply->err);
+	else
+		ret = MHD_queue_response(conn, MHD_HTTP_OK, reply->resp);
+
+	free(reply);
+	return ret;
 }
 
 /**
- * Retrieve either number of game rule sets available or the rules for a specific
- * type of game
+ * State for /new-game in async mode
  */
-enum MHD_Result web_params(struct MHD_Connection *conn) {
-	const char *type_arg;
-	size_t n, i, j, buflen;
-	size_t np;
-	char *buf;
-	struct ioport *iop;
+struct async_new_game {
+	struct async_reply reply;
+	struct user_t user;
+	struct game_t game;
+	bool found;
 	int type;
-	struct game_params_t *params;
-	struct MHD_Response *resp;
-
-	type_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "type");
-	if (!type_arg) {
-		char msg[128];
-		snprintf(msg, sizeof(msg), "{\"rulesets\":%zu}", get_number_of_games());
-		return MHD_queue_response(conn, MHD_HTTP_OK, web_reply_json(msg));
-	}
+	bool has_seed;
+	uint64_t seed;
+};
 
-	type = atoi(type_arg);
-	params = get_game_params(type);
-	if (!params)
-		return web_bad_arg(conn, "type");
+static void async_new_game_created(void *priv, error_t *err) {
+	struct async_new_game *req = priv;
 
-	// Approximate buffer length expected to hold a set of game parameters, if
-	// the games get bigger make this estimate larger:
-	// up to 9 digits per double value + comma, with n marginals and n^2 covariances
-	// up to 6 digits per goal parameter
-	// + 64 bytes for labels + json padding
-	np = 0;
-	for (i = 0; i < params->n_goals; ++i) {
-		j = 0;
-		while (!is_flag_set(params->goals[i].params[j], GOAL_TAIL_BIT)) {
-			j += 1;
-			np += 1;
-		}
+	if (err == OK) {
+		req->reply.resp = web_reply_new_game(&req->game, req->has_seed);
+		release_game(&req->game);
 	}
 
-	n = params->rng_params.n;
-	buflen = 64 + 9*n + 9*n*n + 6*np;
-	buf = calloc(buflen, sizeof(*buf));
-	iop = iop_alloc_fixstr(buf, buflen);
+	async_reply_finish(&req->reply, err);
+}
 
-	iop_printf(iop, "{\"type\":%d,\"p\":[", type);
-	for (i = 0; i < n-1; ++i) {
-		iop_printf(iop, "%0.6f,", params->dist_params.marginals[i]);
+static void async_new_game_user(void *priv, error_t *err) {
+	struct async_new_game *req = priv;
+
+	if (NOT_OK(err)) {
+		async_reply_finish(&req->reply, err);
+		return;
 	}
-	iop_printf(iop, "%0.6f],\"Q\":[", params->dist_params.marginals[n-1]);
 
-	for (i = 0; i < n*n-1; ++i) {
-		iop_printf(iop, "%0.6f,", params->dist_params.corr[i]);
+	// Require uuid so that you cannot start games as someone else
+	if (!req->found) {
+		DEBUG("could not find user for (valid) uuid %s\n", req->user.name);
+		req->reply.bad_arg = "user";
+		async_reply_finish(&req->reply, OK);
+		return;
 	}
-	iop_printf(iop, "%0.6f],\"goals\":[", params->dist_params.corr[n*n-1]);
 
-	for (i = 0; i < params->n_goals; ++i) {
-		if (i > 0)
-			iop_printf(iop, ",[");
-		else
-			iop_printf(iop, "[");
+	new_game_async(req->type, &req->user, req->has_seed ? &req->seed : NULL,
+		&req->game, async_new_game_created, req);
+}
 
-		j = 0;
-		while (!is_flag_set(params->goals[i].params[j+1], GOAL_TAIL_BIT)) {
-			iop_printf(iop, "%d,", params->goals[i].params[j]);
-			j += 1;
+/**
+ * /new-game on the event loop, suspended while the user is looked up and the game
+ * is written, in the same way as web_process_person_async()
+ */
+enum MHD_Result web_new_game_async(struct MHD_Connection *conn, void **state) {
+	struct async_new_game *req = *state;
+	const char *bad;
+	uuid_t userid;
+
+	if (!req) {
+		req = calloc(1, sizeof(*req));
+		if (!req)
+			return web_send_error(conn, E_NOMEM);
+
+		bad = new_game_args(conn, userid, &req->type, &req->has_seed, &req->seed);
+		if (bad) {
+			free(req);
+			return web_bad_arg(conn, bad);
+		}
+
+		req->reply.conn = conn;
+		req->reply.in_handler = true;
+		find_user_async(userid, &req->user, &req->found, async_new_game_user, req);
+		req->reply.in_handler = false;
+
+		if (!req->reply.done) {
+			*state = req;
+			MHD_suspend_connection(conn);
+			return MHD_YES;
 		}
-		iop_printf(iop, "%d]", params->goals[i].params[j]);
 	}
-	iop_printf(iop, "]}");
 
-	iop_free(iop);
-	resp = web_reply_json(buf);
-	free(buf);
-	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+	return async_reply_send(conn, state, &req->reply);
 }
 
-enum MHD_Result web_gameid(struct MHD_Connection *conn) {
-	struct valkey_t *vk;
-	valkeyReply *reply;
-	char msg[128];
+/**
+ * State for /process-person in async mode
+ */
+struct async_person {
+	struct async_reply reply;
+	struct game_t game;
+	bool have_game;
+	bool has_verdict;
+	bool verdict;
+	int person;
+	bool bin;
+};
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "GET next_game");
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		error_t *ret = E_VALKEY(vk->ctx, reply);
-		freeReplyObject(reply);
-		release_valkey(vk);
-		return web_send_error(conn, ret);
+static void async_person_finish(struct async_person *req, error_t *err) {
+	if (err == OK && !req->reply.bad_arg)
+		req->reply.resp = web_reply_game(&req->game, req->bin);
+
+	if (req->have_game)
+		release_game(&req->game);
+
+	async_reply_finish(&req->reply, err);
+}
+
+static void async_person_processed(void *priv, error_t *err) {
+	async_person_finish(priv, err);
+}
+
+static void async_person_found(void *priv, error_t *err) {
+	struct async_person *req = priv;
+
+	if (NOT_OK(err)) {
+		error_free(err);
+		req->reply.bad_arg = "game";
+		async_person_finish(req, OK);
+		return;
 	}
 
-	snprintf(msg, sizeof(msg), "{\"gameid\":%s}", reply->str);
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return MHD_queue_response(conn, MHD_HTTP_OK, web_reply_json(msg));
+	req->have_game = true;
+	if (!req->has_verdict) {
+		async_person_finish(req, OK);
+		return;
+	}
+
+	if (req->person != (int) req->game.count) {
+		async_person_finish(req, E_MSG("wrong person"));
+		return;
+	}
+
+	process_next_person_async(&req->game, req->verdict, async_person_processed, req);
 }
 
-error_t *describe_game(struct ioport *iop, uint32_t id) {
-	struct game_t game = {0};
+/**
+ * /process-person on the event loop. The first call starts finding the game and
+ * suspends the connection if valkey has to be waited on, and MHD calls again once
+ * the connection is resumed to send the reply.
+ */
+enum MHD_Result web_process_person_async(struct MHD_Connection *conn, void **state,
+	bool bin)
+{
+	struct async_person *req = *state;
+	const char *verdict_arg;
+	const char *game_arg;
+	const char *person_arg;
+	uuid_t gameid;
+
+	if (!req) {
+		game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
+		if (!game_arg || uuid_parse(game_arg, gameid) < 0)
+			return web_bad_arg(conn, "game");
+
+		person_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "person");
+		if (!person_arg)
+			return web_bad_arg(conn, "person");
+
+		req = calloc(1, sizeof(*req));
+		if (!req)
+			return web_send_error(conn, E_NOMEM);
+
+		verdict_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND,
+			"verdict");
+		req->reply.conn = conn;
+		req->bin = bin;
+		req->person = atoi(person_arg);
+		req->has_verdict = verdict_arg != NULL;
+		req->verdict = verdict_arg && !STRING_EQUALS(verdict_arg, "false");
+
+		req->reply.in_handler = true;
+		find_game_async(gameid, &req->game, async_person_found, req);
+		req->reply.in_handler = false;
+
+		if (!req->reply.done) {
+			*state = req;
+			MHD_suspend_connection(conn);
+			return MHD_YES;
+		}
+	}
+
+	return async_reply_send(conn, state, &req->reply);
+}
+
+/**
+ * Write the /bin/details layout for a game, returning its length
+ */
+size_t format_details_bin(uint8_t *buf, struct game_t *game, struct user_t *user) {
+	size_t namelen = strnlen(user->realname, USER_NAME_LEN);
+
+	format_game_bin(buf, game);
+	bin_put_u32(buf + 8, game->accepted);
+	bin_put_u32(buf + 12, game->userid);
+	buf[16] = (uint8_t) game->type;
+	buf[17] = MAX_ATTRS;
+	buf[18] = (uint8_t) namelen;
+	buf[19] = 0;
+
+	for (size_t i = 0; i < MAX_ATTRS; ++i) {
+		bin_put_u32(buf + 20 + 4*i, game->attr_n[i]);
+	}
+	memcpy(buf + 20 + 4*MAX_ATTRS, user->realname, namelen);
+
+	return BIN_DETAILS_LEN(MAX_ATTRS, namelen);
+}
+
+enum MHD_Result web_process_game_details(struct MHD_Connection *conn, bool bin) {
+	const char *game_arg;
+	struct MHD_Response *resp;
+	struct ioport *iop;
 	error_t *ret;
+	char msg[256 + GOALS_JSON_LEN];
+	char goals[GOALS_JSON_LEN];
+	bool found;
+	struct game_t game = {0};
+	struct user_t user = {0};
 
-	ret = find_game_by_id(id, &game);
+	game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
+	if (!game_arg)
+		return web_bad_arg(conn, "game");
+
+	ret = find_game_string(game_arg, &game);
 	if (NOT_OK(ret)) {
 		error_free(ret);
-		iop_printf(iop, "{}");
-		return OK;
+		return web_bad_arg(conn, "game");
+	}
+
+	ret = find_user_by_id(game.userid, &user, &found);
+	if (NOT_OK(ret)) {
+		release_game(&game);
+		return web_send_error(conn, ret);
+	}
+
+	if (!found) {
+		DEBUG("game userid: %d\n", game.userid);
+		release_game(&game);
+		return web_bad_arg(conn, "game");
+	}
+
+	if (bin) {
+		uint8_t buf[BIN_DETAILS_LEN(MAX_ATTRS, USER_NAME_LEN)];
+		size_t len;
+
+		len = format_details_bin(buf, &game, &user);
+		release_game(&game);
+
+		resp = web_reply_bin(buf, len);
+		return MHD_queue_response(conn, MHD_HTTP_OK, resp);
 	}
 
+	iop = iop_alloc_fixstr(msg, sizeof(msg));
+
 	iop_printf(iop,
-		"{\"id\":%u,\"count\":%u,\"accepted\":%u,\"type\":%u,",
-		game.id, game.count, game.accepted, game.type);
+		"{\"count\":%u,\"user\":\"%s\",\"accepted\":%u,\"next\":%u,\"attrs\":[",
+		game.count, user.realname, game.accepted, game.next);
+	for (size_t i = 0; i < MAX_ATTRS-1; ++i) {
+		iop_printf(iop, "%u,", game.attr_n[i]);
+	}
+	iop_printf(iop, "%u],\"type\":%d", game.attr_n[MAX_ATTRS-1], game.type);
+	format_goals(goals, sizeof(goals), &game);
+	iop_printf(iop, "%s", goals);
 
 	if (game_is_finished(&game)) {
-		iop_printf(iop, "\"finished\":true,\"won\":%s}",
+		iop_printf(iop, ",\"finished\":true,\"won\":%s",
 			game.goals_satisfied ? "true" : "false");
 	}
+
+	iop_printf(iop, "}");
+
+	iop_free(iop);
+	release_game(&game);
+
+	resp = web_reply_json(msg);
+	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+}
+
+/**
+ * The history of a game. Finished games are served from the symbols cache without
+ * touching valkey, and otherwise the reply is rendered once at its exact size and
+ * handed to MHD without another copy.
+ */
+enum MHD_Result web_symbols(struct MHD_Connection *conn, bool bin) {
+	const char *game_arg;
+	struct MHD_Response *resp;
+	enum MHD_Result result;
+	char *msg;
+	size_t msglen;
+	error_t *ret;
+	struct game_t game = {0};
+
+	game_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "game");
+	if (!game_arg)
+		return web_bad_arg(conn, "game");
+
+	if (symbols_cache_queue(conn, game_arg, bin, &result))
+		return result;
+
+	ret = find_game_string(game_arg, &game);
+	if (NOT_OK(ret)) {
+		error_free(ret);
+		return web_bad_arg(conn, "game");
+	}
+
+	// The history is already one byte per patron
+	if (bin) {
+		resp = web_reply_bin(game.seen, game.count);
+	}
 	else {
-		iop_printf(iop, "\"finished\":false}");
+		msg = format_symbols(game.seen, game.count, &msglen);
+		if (!msg) {
+			release_game(&game);
+			return web_send_error(conn, E_NOMEM);
+		}
+		resp = web_reply(msg, msglen, MHD_RESPMEM_MUST_FREE, "application/json");
 	}
 
+	result = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+
+	if (game_is_finished(&game))
+		symbols_cache_add(&game, bin, resp);
+	else
+		MHD_destroy_response(resp);
+
 	release_game(&game);
-	return OK;
+	return result;
 }
 
-enum MHD_Result web_recent_games(struct MHD_Connection *conn) {
-	struct valkey_t *vk;
-	valkeyReply *reply;
-	char *buf;
-	size_t buflen;
+/**
+ * Write the /bin/params layout for a game type, into a buffer sized for its goals
+ */
+void format_params_bin(uint8_t *buf, int type, struct game_params_t *params) {
+	size_t n = params->rng_params.n;
+	size_t pos = 4;
+	size_t i, j;
+
+	buf[0] = (uint8_t) type;
+	buf[1] = (uint8_t) n;
+	buf[2] = (uint8_t) params->n_goals;
+	buf[3] = 0;
+
+	for (i = 0; i < n; ++i) {
+		bin_put_f32(buf + pos, params->dist_params.marginals[i]);
+		pos += 4;
+	}
+
+	for (i = 0; i < n*n; ++i) {
+		bin_put_f32(buf + pos, params->dist_params.corr[i]);
+		pos += 4;
+	}
+
+	for (i = 0; i < params->n_goals; ++i) {
+		uint32_t *terms = params->goals[i].params;
+
+		j = 0;
+		while (!is_flag_set(terms[j], GOAL_TAIL_BIT))
+			j += 1;
+
+		buf[pos++] = (uint8_t) j;
+		for (j = 0; !is_flag_set(terms[j], GOAL_TAIL_BIT); ++j) {
+			bin_put_u16(buf + pos, terms[j]);
+			pos += 2;
+		}
+	}
+}
+
+/**
+ * Count the goal terms for a game type, not including the tails
+ */
+static size_t count_goal_terms(struct game_params_t *params) {
+	size_t np = 0;
+
+	for (size_t i = 0; i < params->n_goals; ++i) {
+		size_t j = 0;
+		while (!is_flag_set(params->goals[i].params[j], GOAL_TAIL_BIT)) {
+			j += 1;
+			np += 1;
+		}
+	}
+
+	return np;
+}
+
+/**
+ * Render the json rules for a game type into a new buffer
+ */
+static char *render_params_json(int type, struct game_params_t *params, size_t *len) {
+	size_t n, i, j, buflen;
 	struct ioport *iop;
+	char *buf;
+
+	// Approximate buffer length expected to hold a set of game parameters, if
+	// the games get bigger make this estimate larger:
+	// up to 9 digits per double value + comma, with n marginals and n^2 covariances
+	// up to 6 digits per goal parameter
+	// + 64 bytes for labels + json padding
+	n = params->rng_params.n;
+	buflen = 64 + 9*n + 9*n*n + 6*count_goal_terms(params);
+	buf = calloc(buflen, sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	iop = iop_alloc_fixstr(buf, buflen);
+
+	iop_printf(iop, "{\"type\":%d,\"p\":[", type);
+	for (i = 0; i < n-1; ++i) {
+		iop_printf(iop, "%0.6f,", params->dist_params.marginals[i]);
+	}
+	iop_printf(iop, "%0.6f],\"Q\":[", params->dist_params.marginals[n-1]);
+
+	for (i = 0; i < n*n-1; ++i) {
+		iop_printf(iop, "%0.6f,", params->dist_params.corr[i]);
+	}
+	iop_printf(iop, "%0.6f],\"goals\":[", params->dist_params.corr[n*n-1]);
+
+	for (i = 0; i < params->n_goals; ++i) {
+		if (i > 0)
+			iop_printf(iop, ",[");
+		else
+			iop_printf(iop, "[");
+
+		j = 0;
+		while (!is_flag_set(params->goals[i].params[j+1], GOAL_TAIL_BIT)) {
+			iop_printf(iop, "%d,", params->goals[i].params[j]);
+			j += 1;
+		}
+		iop_printf(iop, "%d]", params->goals[i].params[j]);
+	}
+	iop_printf(iop, "]}");
+
+	iop_free(iop);
+	*len = strlen(buf);
+	return buf;
+}
+
+/**
+ * Render the binary rules for a game type into a new buffer
+ */
+static uint8_t *render_params_bin(int type, struct game_params_t *params, size_t *len) {
+	uint8_t *buf;
+
+	// A byte for the length of each goal and two for each of its terms
+	*len = BIN_PARAMS_LEN(params->rng_params.n) + params->n_goals +
+		2*count_goal_terms(params);
+	buf = calloc(*len, sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	format_params_bin(buf, type, params);
+	return buf;
+}
+
+/**
+ * Game rules only change when the server restarts, so every /params reply is made
+ * once at startup and then sent as is. Clients can revalidate with the ETag, which
+ * is a hash of the body.
+ */
+struct params_reply {
 	struct MHD_Response *resp;
+	struct MHD_Response *not_modified;
+	char etag[24];
+};
+
+// Indexed by whether the reply is binary, then by type + 1, with 0 for the count
+static struct params_reply *params_replies[2];
+
+static uint64_t fnv1a(const uint8_t *buf, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Make the replies for one rendered body, taking ownership of the buffer
+ */
+static error_t *make_params_reply(struct params_reply *reply, void *buf, size_t len,
+	bool bin)
+{
+	char max_age[32];
+
+	if (!buf)
+		return E_NOMEM;
+
+	snprintf(reply->etag, sizeof(reply->etag), "\"%016llx\"",
+		(unsigned long long) fnv1a(buf, len));
+	snprintf(max_age, sizeof(max_age), "public, max-age=%d", PARAMS_MAX_AGE);
+
+	reply->resp = web_reply(buf, len, MHD_RESPMEM_MUST_FREE,
+		bin ? BIN_CONTENT_TYPE : "application/json");
+	reply->not_modified = web_reply(NULL, 0, MHD_RESPMEM_PERSISTENT,
+		bin ? BIN_CONTENT_TYPE : "application/json");
+	if (!reply->resp || !reply->not_modified)
+		return E_NOMEM;
+
+	MHD_add_response_header(reply->resp, MHD_HTTP_HEADER_ETAG, reply->etag);
+	MHD_add_response_header(reply->resp, MHD_HTTP_HEADER_CACHE_CONTROL, max_age);
+	MHD_add_response_header(reply->not_modified, MHD_HTTP_HEADER_ETAG, reply->etag);
+	MHD_add_response_header(reply->not_modified, MHD_HTTP_HEADER_CACHE_CONTROL, max_age);
+	return OK;
+}
+
+error_t *init_params_replies(void) {
+	size_t n_games = get_number_of_games();
+	size_t len;
 	error_t *ret;
-	int n, i;
+	char *msg;
+	uint8_t *data;
+
+	for (int bin = 0; bin < 2; ++bin) {
+		params_replies[bin] = calloc(n_games + 1, sizeof(struct params_reply));
+		if (!params_replies[bin])
+			return E_NOMEM;
+	}
+
+	msg = malloc(64);
+	if (msg)
+		snprintf(msg, 64, "{\"rulesets\":%zu}", n_games);
+	ret = make_params_reply(&params_replies[0][0], msg, msg ? strlen(msg) : 0, false);
+	if (NOT_OK(ret))
+		return ret;
+
+	data = malloc(4);
+	if (data)
+		bin_put_u32(data, n_games);
+	ret = make_params_reply(&params_replies[1][0], data, 4, true);
+	if (NOT_OK(ret))
+		return ret;
+
+	for (size_t type = 0; type < n_games; ++type) {
+		struct game_params_t *params = get_game_params(type);
+
+		msg = render_params_json(type, params, &len);
+		ret = make_params_reply(&params_replies[0][type + 1], msg, len, false);
+		if (NOT_OK(ret))
+			return ret;
+
+		data = render_params_bin(type, params, &len);
+		ret = make_params_reply(&params_replies[1][type + 1], data, len, true);
+		if (NOT_OK(ret))
+			return ret;
+	}
+
+	return OK;
+}
+
+/**
+ * Retrieve either number of game rule sets available or the rules for a specific
+ * type of game
+ */
+enum MHD_Result web_params(struct MHD_Connection *conn, bool bin) {
+	const char *type_arg;
+	const char *match;
+	struct params_reply *reply;
+	size_t idx = 0;
+	int type;
+
+	type_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "type");
+	if (type_arg) {
+		type = atoi(type_arg);
+		if (!get_game_params(type))
+			return web_bad_arg(conn, "type");
+		idx = type + 1;
+	}
+
+	reply = &params_replies[bin][idx];
+
+	match = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+		MHD_HTTP_HEADER_IF_NONE_MATCH);
+	if (match && (STRING_EQUALS(match, "*") || strstr(match, reply->etag)))
+		return MHD_queue_response(conn, MHD_HTTP_NOT_MODIFIED, reply->not_modified);
+
+	return MHD_queue_response(conn, MHD_HTTP_OK, reply->resp);
+}
+
+enum MHD_Result web_gameid(struct MHD_Connection *conn) {
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	char msg[128];
 
 	vk = get_valkey();
+	if (!vk)
+		return web_send_error(conn, E_VALKEY_BUSY);
+
 	reply = valkeyCommand(vk->ctx, "GET next_game");
 	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
 		error_t *ret = E_VALKEY(vk->ctx, reply);
@@ -524,51 +1225,83 @@ enum MHD_Result web_recent_games(struct MHD_Connection *conn) {
 		return web_send_error(conn, ret);
 	}
 
-	// same approach as in user games just fixed number of recent games
-	buflen = 64 + 64*RECENT_GAME_LIMIT;
+	snprintf(msg, sizeof(msg), "{\"gameid\":%s}", reply->str);
+	freeReplyObject(reply);
+	release_valkey(vk);
+	return MHD_queue_response(conn, MHD_HTTP_OK, web_reply_json(msg));
+}
+
+void describe_game(struct ioport *iop, struct game_summary *summary) {
+	if (!summary->found) {
+		iop_printf(iop, "{}");
+		return;
+	}
+
+	iop_printf(iop,
+		"{\"id\":%u,\"count\":%u,\"accepted\":%u,\"type\":%u,",
+		summary->id, summary->count, summary->accepted, summary->type);
+
+	if (summary->status != GAME_RUNNING) {
+		iop_printf(iop, "\"finished\":true,\"won\":%s}",
+			summary->status == GAME_COMPLETED ? "true" : "false");
+	}
+	else {
+		iop_printf(iop, "\"finished\":false}");
+	}
+}
+
+/**
+ * Reply with a list of summarized games
+ */
+enum MHD_Result web_describe_games(struct MHD_Connection *conn,
+	struct game_summary *games, size_t n)
+{
+	struct MHD_Response *resp;
+	struct ioport *iop;
+	size_t buflen;
+	char *buf;
+
+	// number of games * some descriptor length guess + scaffolding
+	buflen = 64 + 96*n;
 	buf = calloc(buflen, sizeof(*buf));
 	if (!buf)
-		goto failure_noiop;
+		return web_send_error(conn, E_NOMEM);
 
 	iop = iop_alloc_fixstr(buf, buflen);
-	if (!iop)
-		goto failure_nobuf;
+	if (!iop) {
+		free(buf);
+		return web_send_error(conn, E_NOMEM);
+	}
 
-	n = atoi(reply->str);
 	iop_printf(iop, "{\"games\":[");
-	if (n > 0) {
-		for (i = 0; i < RECENT_GAME_LIMIT && n - i >= 1; ++i) {
-			ret = describe_game(iop, n - i);
-			if (NOT_OK(ret))
-				goto failure;
+	for (size_t i = 0; i < n; ++i) {
+		if (i > 0)
 			iop_printf(iop, ",");
-		}
-
-		ret = describe_game(iop, n - i);
-		if (NOT_OK(ret))
-			goto failure;
+		describe_game(iop, &games[i]);
 	}
 	iop_printf(iop, "]}");
 
 	iop_free(iop);
 	resp = web_reply_json(buf);
 	free(buf);
-	freeReplyObject(reply);
-	release_valkey(vk);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+}
 
-failure:
-	iop_free(iop);
-failure_noiop:
-	free(buf);
-failure_nobuf:
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return web_send_error(conn, ret);
+/**
+ * Served from the in memory ring, see recent.c
+ */
+enum MHD_Result web_recent_games(struct MHD_Connection *conn) {
+	struct game_summary games[RECENT_RING_SIZE];
+	size_t n;
+
+	n = recent_games(games);
+	return web_describe_games(conn, games, n);
 }
 
 enum MHD_Result web_lookup(struct MHD_Connection *conn) {
 	const char *user_arg;
+	error_t *ret;
+	bool found;
 	struct user_t user = {0};
 	char msg[128];
 
@@ -576,7 +1309,11 @@ enum MHD_Result web_lookup(struct MHD_Connection *conn) {
 	if (!user_arg)
 		return web_bad_arg(conn, "name");
 
-	if (!find_user_by_string(user_arg, &user))
+	ret = find_user_by_string(user_arg, &user, &found);
+	if (NOT_OK(ret))
+		return web_send_error(conn, ret);
+
+	if (!found)
 		return web_bad_arg(conn, "name");
 
 	snprintf(msg, sizeof(msg),
@@ -587,76 +1324,178 @@ enum MHD_Result web_lookup(struct MHD_Connection *conn) {
 }
 
 enum MHD_Result web_user_games(struct MHD_Connection *conn) {
+	struct game_summary games[VALKEY_USER_GAME_HISTORY] = {0};
 	const char *user_arg;
-	struct valkey_t *vk;
 	valkeyReply *reply;
-	char *buf;
-	size_t buflen;
-	struct ioport *iop;
-	struct MHD_Response *resp;
 	error_t *ret;
+	bool found;
+	size_t n = 0;
 	struct user_t user = {0};
 
 	user_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "name");
 	if (!user_arg)
 		return web_bad_arg(conn, "name");
 
-	if (!find_user_by_string(user_arg, &user))
+	if (recent_user_games(user_arg, games, &n))
+		return web_describe_games(conn, games, n);
+
+	// The first time a user's games are asked for they are read from valkey, and
+	// from then on kept up to date in memory
+	ret = find_user_by_string(user_arg, &user, &found);
+	if (NOT_OK(ret))
+		return web_send_error(conn, ret);
+
+	if (!found)
 		return web_bad_arg(conn, "name");
 
-	vk = get_valkey();
-	reply = valkeyCommand(vk->ctx, "LRANGE %s-games 0 -1", user.name);
-	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
-		error_t *ret = E_VALKEY(vk->ctx, reply);
-		freeReplyObject(reply);
-		release_valkey(vk);
+	// A user given by id could only be trusted from memory once valkey said that
+	// nobody has it as their name
+	if (recent_user_games_by_id(user.id, games, &n))
+		return web_describe_games(conn, games, n);
+
+	recent_user_track(&user);
+
+	ret = valkey_read(&reply, "LRANGE %s-games 0 %d", user.name,
+		VALKEY_USER_GAME_HISTORY - 1);
+	if (NOT_OK(ret))
 		return web_send_error(conn, ret);
+
+	for (size_t i = 0; i < reply->elements && n < ARRAY_SIZE(games); ++i) {
+		games[n++].id = atoi(reply->element[i]->str);
 	}
+	freeReplyObject(reply);
 
-	// number of games * some descriptor length guess + scaffolding
-	buflen = 64 + 64*reply->elements;
+	ret = find_game_summaries(games, n);
+	if (NOT_OK(ret))
+		return web_send_error(conn, ret);
+
+	recent_user_fill(&user, games, n);
+	return web_describe_games(conn, games, n);
+}
+
+/**
+ * The best won games of a type, fewest rejections first, or with by=user the best
+ * score of each user who has won it
+ */
+enum MHD_Result web_leaderboard(struct MHD_Connection *conn) {
+	const char *type_arg;
+	const char *limit_arg;
+	const char *by_arg;
+	struct MHD_Response *resp;
+	struct ioport *iop;
+	valkeyReply *reply;
+	error_t *ret;
+	bool users;
+	size_t buflen;
+	char key[32];
+	char *buf;
+	long limit = 10;
+	int type;
+
+	type_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "type");
+	if (!type_arg)
+		return web_bad_arg(conn, "type");
+
+	type = atoi(type_arg);
+	if (!get_game_params(type))
+		return web_bad_arg(conn, "type");
+
+	limit_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "limit");
+	if (limit_arg) {
+		limit = atol(limit_arg);
+		if (limit < 1 || limit > LEADERBOARD_LIMIT)
+			return web_bad_arg(conn, "limit");
+	}
+
+	by_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "by");
+	users = by_arg && STRING_EQUALS(by_arg, "user");
+
+	leaderboard_key(key, sizeof(key), type, users);
+	ret = valkey_read(&reply, "ZRANGE %s 0 %ld WITHSCORES", key, limit - 1);
+	if (NOT_OK(ret))
+		return web_send_error(conn, ret);
+
+	// Each entry is an id and a score of up to 10 digits each plus the labels
+	buflen = 64 + 48*(reply->elements / 2);
 	buf = calloc(buflen, sizeof(*buf));
-	if (!buf)
-		goto failure_nobuf;
+	if (!buf) {
+		freeReplyObject(reply);
+		return web_send_error(conn, E_NOMEM);
+	}
 
 	iop = iop_alloc_fixstr(buf, buflen);
-	if (!iop)
-		goto failure_noiop;
+	iop_printf(iop, "{\"type\":%d,\"%s\":[", type, users ? "users" : "games");
 
-	iop_printf(iop, "{\"games\":[");
-	if (reply->elements > 0) {
-		for (size_t i = 0; i < reply->elements-1; ++i) {
-			ret = describe_game(iop, atoi(reply->element[i]->str));
-			if (NOT_OK(ret))
-				goto failure;
-			iop_printf(iop, ",");
-		}
-		ret = describe_game(iop, atoi(reply->element[reply->elements-1]->str));
-		if (NOT_OK(ret))
-			goto failure;
+	// Members and scores alternate
+	for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+		iop_printf(iop, "%s{\"id\":%s,\"score\":%s}", i > 0 ? "," : "",
+			reply->element[i]->str, reply->element[i + 1]->str);
 	}
 	iop_printf(iop, "]}");
 
 	iop_free(iop);
+	freeReplyObject(reply);
+
 	resp = web_reply_json(buf);
 	free(buf);
-	freeReplyObject(reply);
-	release_valkey(vk);
 	return MHD_queue_response(conn, MHD_HTTP_OK, resp);
+}
 
-failure:
+/**
+ * Report the valkey pool counters, for diagnosing waits for connections
+ */
+enum MHD_Result web_pool_stats(struct MHD_Connection *conn) {
+	struct valkey_pool_stats stats;
+	struct ioport *iop;
+	char msg[512];
+
+	valkey_pool_stats(&stats);
+
+	iop = iop_alloc_fixstr(msg, sizeof(msg));
+	iop_printf(iop,
+		"{\"size\":%zu,\"in_use\":%zu,\"waiting\":%zu,\"checkouts\":%lu,"
+		"\"timeouts\":%lu,\"reconnects\":%lu,\"wait_us_log2\":[",
+		stats.size, stats.in_use, stats.waiting, stats.checkouts, stats.timeouts,
+		stats.reconnects);
+	for (size_t i = 0; i < VALKEY_WAIT_BUCKETS-1; ++i) {
+		iop_printf(iop, "%lu,", stats.wait[i]);
+	}
+	iop_printf(iop, "%lu]}", stats.wait[VALKEY_WAIT_BUCKETS-1]);
 	iop_free(iop);
-failure_noiop:
-	free(buf);
-failure_nobuf:
-	freeReplyObject(reply);
-	release_valkey(vk);
-	return web_send_error(conn, ret);
+
+	return MHD_queue_response(conn, MHD_HTTP_OK, web_reply_json(msg));
+}
+
+/**
+ * A client that goes away while its request is suspended never gets the second call
+ * to its async handler, so everything the request held is freed here instead,
+ * including a reply that was built but never queued
+ */
+void web_completed(void *context, struct MHD_Connection *conn, void **state,
+	enum MHD_RequestTerminationCode toe)
+{
+	struct async_reply *reply = *state;
+
+	UNUSED(context);
+	UNUSED(conn);
+	UNUSED(toe);
+
+	if (!reply)
+		return;
+
+	if (NOT_OK(reply->err))
+		error_free(reply->err);
+	if (reply->resp)
+		MHD_destroy_response(reply->resp);
+	free(reply);
+	*state = NULL;
 }
 
 /**
- * Handle a new request, each of these is called in its own thread by the
- * MHD internals for now
+ * Handle a new request. Depending on the server mode this runs on MHD's polling
+ * thread, one of its pool threads, a thread for the connection, or the event loop,
+ * so handlers must be safe to run concurrently but cannot assume a thread of their
+ * own to block in.
  */
 enum MHD_Result web_entry(void *context, struct MHD_Connection *conn, const char *url,
 	const char *method, const char *version, const char *upload, size_t *upload_size,
@@ -666,7 +1505,6 @@ enum MHD_Result web_entry(void *context, struct MHD_Connection *conn, const char
 	UNUSED(version);
 	UNUSED(upload);
 	UNUSED(upload_size);
-	UNUSED(state);
 
 	if (!STRING_EQUALS(method, "GET"))
 		return MHD_NO;
@@ -674,20 +1512,47 @@ enum MHD_Result web_entry(void *context, struct MHD_Connection *conn, const char
 	if (STRING_EQUALS(url, "/new-user"))
 		return web_new_user(conn);
 
-	if (STRING_EQUALS(url, "/new-game"))
+	if (STRING_EQUALS(url, "/new-game")) {
+		if (cfg.mode == MODE_ASYNC)
+			return web_new_game_async(conn, state);
 		return web_new_game(conn);
+	}
+
+	if (STRING_EQUALS(url, "/process-person")) {
+		if (cfg.mode == MODE_ASYNC)
+			return web_process_person_async(conn, state, false);
+		return web_process_person(conn, false);
+	}
+
+	if (STRING_EQUALS(url, "/bin/process-person")) {
+		if (cfg.mode == MODE_ASYNC)
+			return web_process_person_async(conn, state, true);
+		return web_process_person(conn, true);
+	}
+
+	if (STRING_EQUALS(url, "/process-policy"))
+		return web_process_policy(conn);
 
-	if (STRING_EQUALS(url, "/process-person"))
-		return web_process_person(conn);
+	if (STRING_EQUALS(url, "/stream"))
+		return web_stream(conn);
 
 	if (STRING_EQUALS(url, "/details"))
-		return web_process_game_details(conn);
+		return web_process_game_details(conn, false);
+
+	if (STRING_EQUALS(url, "/bin/details"))
+		return web_process_game_details(conn, true);
 
 	if (STRING_EQUALS(url, "/symbols"))
-		return web_symbols(conn);
+		return web_symbols(conn, false);
+
+	if (STRING_EQUALS(url, "/bin/symbols"))
+		return web_symbols(conn, true);
 
 	if (STRING_EQUALS(url, "/params"))
-		return web_params(conn);
+		return web_params(conn, false);
+
+	if (STRING_EQUALS(url, "/bin/params"))
+		return web_params(conn, true);
 
 	if (STRING_EQUALS(url, "/gameid"))
 		return web_gameid(conn);
@@ -701,6 +1566,12 @@ enum MHD_Result web_entry(void *context, struct MHD_Connection *conn, const char
 	if (STRING_EQUALS(url, "/lookup"))
 		return web_lookup(conn);
 
+	if (STRING_EQUALS(url, "/leaderboard"))
+		return web_leaderboard(conn);
+
+	if (STRING_EQUALS(url, "/pool-stats"))
+		return web_pool_stats(conn);
+
 	DEBUG("failed to match any routes for %s\n", url);
 	return MHD_NO;
 }
@@ -715,45 +1586,134 @@ void reinit_db(void) {
 	struct valkey_t *vk;
 	valkeyReply *reply;
 	valkeyReply *inner;
+	const char **argv;
+	size_t *argvlen;
 
 	vk = get_valkey();
+	if (!vk) {
+		ERROR("no valkey connection for reinitialization, fatal\n");
+		exit(1);
+	}
+
 	reply = valkeyCommand(vk->ctx, "KEYS *");
 	if (!reply || reply->type == VALKEY_REPLY_ERROR) {
 		ERROR("valkey failure during reinitialization, fatal\n");
 		exit(1);
 	}
 
+	if (reply->elements == 0)
+		goto done;
+
+	// Every key goes in a single DEL rather than a round trip each
+	argv = calloc(reply->elements + 1, sizeof(*argv));
+	argvlen = calloc(reply->elements + 1, sizeof(*argvlen));
+	ASSERT(argv && argvlen);
+
+	argv[0] = "DEL";
+	argvlen[0] = 3;
 	for (size_t i = 0; i < reply->elements; ++i) {
-		inner = valkeyCommand(vk->ctx, "DEL %s", reply->element[i]->str);
-		if (!inner || inner->type == VALKEY_REPLY_ERROR) {
-			ERROR("failed to delete key %s, fatal\n", reply->element[i]->str);
-			exit(1);
-		}
-		freeReplyObject(inner);
+		argv[i + 1] = reply->element[i]->str;
+		argvlen[i + 1] = reply->element[i]->len;
 	}
 
+	inner = valkeyCommandArgv(vk->ctx, reply->elements + 1, argv, argvlen);
+	if (!inner || inner->type == VALKEY_REPLY_ERROR) {
+		ERROR("failed to delete %zu keys, fatal\n", reply->elements);
+		exit(1);
+	}
+
+	freeReplyObject(inner);
+	free(argvlen);
+	free(argv);
+done:
 	freeReplyObject(reply);
 	release_valkey(vk);
 }
 
 void show_help(void) {
 	printf("\n");
-	printf(" berghain-server [-h] [-r]\n");
+	printf(" berghain-server [-h] [-r] [-m mode] [-t threads] [-c limit] [-T seconds]\n");
+	printf("                 [-k] [-p size] [-w ms] [-e]\n");
 	printf("\n");
 	printf("   -h      Show this help\n");
 	printf("   -r      Reset valkey database (removes ALL keys)\n");
+	printf("   -m      Server mode: select (default), conn, pool or async\n");
+	printf("   -t      Threads in pool mode (default one per cpu)\n");
+	printf("   -c      Maximum number of connections (default MHD limit)\n");
+	printf("   -T      Seconds before an idle connection is closed (default never)\n");
+	printf("   -k      Disable keep-alive, closing connections after each reply\n");
+	printf("   -p      Number of valkey connections (default %d)\n", VALKEY_POOL_SIZE);
+	printf("   -w      Milliseconds to wait for a valkey connection (default %d)\n",
+		VALKEY_POOL_TIMEOUT_MS);
+	printf("   -e      End games as soon as their goals are certain to fail or succeed\n");
 	printf("\n");
 	exit(1);
 }
 
+static bool parse_mode(const char *name, enum server_mode *mode) {
+	for (size_t i = 0; i < ARRAY_SIZE(mode_names); ++i) {
+		if (STRING_EQUALS(name, mode_names[i])) {
+			*mode = (enum server_mode) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Start MHD according to the server configuration
+ */
+struct MHD_Daemon *start_daemon(void) {
+	struct MHD_OptionItem opts[8];
+	unsigned int flags;
+	size_t n = 0;
+
+	switch (cfg.mode) {
+	case MODE_SELECT:
+	default:
+		flags = MHD_USE_INTERNAL_POLLING_THREAD;
+		break;
+	case MODE_CONN:
+		flags = MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_THREAD_PER_CONNECTION;
+		break;
+	case MODE_POOL:
+		flags = MHD_USE_EPOLL_INTERNAL_THREAD;
+		opts[n++] = (struct MHD_OptionItem) { MHD_OPTION_THREAD_POOL_SIZE,
+			cfg.threads ? cfg.threads : sysconf(_SC_NPROCESSORS_ONLN), NULL };
+		break;
+	case MODE_ASYNC:
+		flags = MHD_USE_EPOLL | MHD_ALLOW_SUSPEND_RESUME;
+		opts[n++] = (struct MHD_OptionItem) { MHD_OPTION_NOTIFY_COMPLETED,
+			(intptr_t) &web_completed, NULL };
+		break;
+	}
+
+	if (cfg.conn_limit)
+		opts[n++] = (struct MHD_OptionItem) { MHD_OPTION_CONNECTION_LIMIT,
+			cfg.conn_limit, NULL };
+
+	if (cfg.conn_timeout)
+		opts[n++] = (struct MHD_OptionItem) { MHD_OPTION_CONNECTION_TIMEOUT,
+			cfg.conn_timeout, NULL };
+
+	opts[n++] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+
+	// Every mode hands upgraded connections to a session thread, see stream.c
+	flags |= MHD_ALLOW_UPGRADE;
+
+	DEBUG("starting mhd in %s mode\n", mode_names[cfg.mode]);
+	return MHD_start_daemon(flags, GAME_PORT, NULL, NULL, &web_entry, NULL,
+		MHD_OPTION_ARRAY, opts, MHD_OPTION_END);
+}
+
 int main(int argc, char **argv) {
-	char c;
+	int c;
 	int opt;
 	bool reset = false;
 	struct MHD_Daemon *daemon;
 	error_t *ret;
 
-	while ((opt = getopt(argc, argv, "hr")) != -1) {
+	while ((opt = getopt(argc, argv, "hrm:t:c:T:kp:w:e")) != -1) {
 		switch (opt) {
 		case 'h': /* fallthrough */
 		default:
@@ -763,6 +1723,41 @@ int main(int argc, char **argv) {
 			DEBUG("reset valkey database\n");
 			reset = true;
 			break;
+		case 'm':
+			if (!parse_mode(optarg, &cfg.mode))
+				show_help();
+			break;
+		case 't':
+			if (atoi(optarg) < 1)
+				show_help();
+			cfg.threads = atoi(optarg);
+			break;
+		case 'c':
+			if (atoi(optarg) < 1)
+				show_help();
+			cfg.conn_limit = atoi(optarg);
+			break;
+		case 'T':
+			if (atoi(optarg) < 1)
+				show_help();
+			cfg.conn_timeout = atoi(optarg);
+			break;
+		case 'k':
+			cfg.keep_alive = false;
+			break;
+		case 'p':
+			if (atoi(optarg) < 1)
+				show_help();
+			valkey_set_pool_size(atoi(optarg));
+			break;
+		case 'w':
+			if (atoi(optarg) < 1)
+				show_help();
+			valkey_set_pool_timeout(atoi(optarg));
+			break;
+		case 'e':
+			game_set_early_end(true);
+			break;
 		}
 	}
 
@@ -775,20 +1770,49 @@ int main(int argc, char **argv) {
 	if (reset)
 		reinit_db();
 
-	daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, GAME_PORT, NULL, NULL,
-		&web_entry, NULL, MHD_OPTION_END);
+	ret = init_params_replies();
+	if (NOT_OK(ret)) {
+		error_print(ret);
+		exit(1);
+	}
+
+	ret = init_recent();
+	if (NOT_OK(ret)) {
+		error_print(ret);
+		exit(1);
+	}
+
+	if (cfg.mode == MODE_ASYNC)
+		init_game_async();
+
+	daemon = start_daemon();
 	if (!daemon) {
 		ERROR("failed to start mhd daemon\n");
 		exit(1);
 	}
 
+	if (cfg.mode == MODE_ASYNC) {
+		ret = async_start(daemon);
+		if (NOT_OK(ret)) {
+			error_print(ret);
+			exit(1);
+		}
+	}
+
 	DEBUG("web server active, game is ready\n");
 
-	while ((c = getchar())) {
+	while ((c = getchar()) != EOF) {
 		if (c == 'q')
 			break;
 	}
 
+	// Without a terminal, such as when run in the background, serve until killed
+	if (c == EOF)
+		pause();
+
+	if (cfg.mode == MODE_ASYNC)
+		async_stop();
+
 	MHD_stop_daemon(daemon);
 	return 0;
 }
@@ -0,0 +1,254 @@
+#include <math.h>
+#include <string.h>
+
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "normals.h"
+#include "rng.h"
+
+// Kernels are built once per instruction set and the best one is picked at load
+// time, with the default clone as the scalar fallback
+#define NORMALS_KERNEL \
+	__attribute__((target_clones("avx512f", "avx2", "default"), \
+		optimize("tree-vectorize")))
+
+#define DOUBLE_ONE_BITS 0x3FF0000000000000ULL
+#define DOUBLE_MANTISSA MASK(51, 0)
+#define DOUBLE_ROUND_MAGIC 0x1.8p52
+
+static inline uint64_t double_bits(double x) {
+	uint64_t r;
+	memcpy(&r, &x, sizeof(r));
+	return r;
+}
+
+static inline double bits_double(uint64_t x) {
+	double r;
+	memcpy(&r, &x, sizeof(r));
+	return r;
+}
+
+/**
+ * Natural log for x in (0, 1] using only arithmetic and bit operations so that it
+ * vectorizes. x = m*2^e with m in [sqrt(1/2), sqrt(2)), then log(m) is the atanh
+ * series in s = (m-1)/(m+1), which with |s| < 0.172 is good to about 1e-15 by the
+ * s^17 term.
+ */
+static inline double poly_log(double x) {
+	uint64_t bits = double_bits(x);
+	uint64_t mb = (bits & DOUBLE_MANTISSA) | DOUBLE_ONE_BITS;
+	// All ones when the mantissa is above sqrt(2), in which case halve it and move
+	// the difference to the exponent. Selecting with masks keeps the loop branch free
+	uint64_t big = -(uint64_t) (bits_double(mb) > M_SQRT2);
+	uint64_t be = (bits >> 52) + (big & 1);
+	double m = bits_double(mb - (big & BIT(52)));
+	double e, s, s2, p;
+
+	// Small integer to double through the mantissa of 2^52
+	e = bits_double(be | 0x4330000000000000ULL) - 0x1p52 - 1023;
+
+	s = (m - 1) / (m + 1);
+	s2 = s*s;
+	p = 1.0/17;
+	p = p*s2 + 1.0/15;
+	p = p*s2 + 1.0/13;
+	p = p*s2 + 1.0/11;
+	p = p*s2 + 1.0/9;
+	p = p*s2 + 1.0/7;
+	p = p*s2 + 1.0/5;
+	p = p*s2 + 1.0/3;
+	p = p*s2 + 1.0;
+
+	return e*M_LN2 + 2*s*p;
+}
+
+/**
+ * sin and cos of 2*pi*u for u in [0, 1). The angle is split into the nearest
+ * quadrant q and a remainder a in [-pi/4, pi/4], where taylor polynomials to the
+ * a^16 term are accurate to double precision, and then rotated into place.
+ */
+static inline void poly_sincos2pi(double u, double *sn, double *cs) {
+	double v = 4*u;
+	double k = v + DOUBLE_ROUND_MAGIC;
+	uint64_t q = double_bits(k);
+	double a = (v - (k - DOUBLE_ROUND_MAGIC)) * M_PI_2;
+	double a2 = a*a;
+	uint64_t swap = -(q & 1);
+	double s, c;
+	uint64_t rs, rc;
+
+	s = -1.0/1307674368000;
+	s = s*a2 + 1.0/6227020800;
+	s = s*a2 - 1.0/39916800;
+	s = s*a2 + 1.0/362880;
+	s = s*a2 - 1.0/5040;
+	s = s*a2 + 1.0/120;
+	s = s*a2 - 1.0/6;
+	s = (s*a2 + 1.0) * a;
+
+	c = 1.0/20922789888000;
+	c = c*a2 - 1.0/87178291200;
+	c = c*a2 + 1.0/479001600;
+	c = c*a2 - 1.0/3628800;
+	c = c*a2 + 1.0/40320;
+	c = c*a2 - 1.0/720;
+	c = c*a2 + 1.0/24;
+	c = c*a2 - 1.0/2;
+	c = c*a2 + 1.0;
+
+	// Odd quadrants swap sin and cos, sin is negated in quadrants 2 and 3 and cos
+	// is negated in quadrants 1 and 2
+	rs = (double_bits(s) & ~swap) | (double_bits(c) & swap);
+	rc = (double_bits(c) & ~swap) | (double_bits(s) & swap);
+	*sn = bits_double(rs ^ ((q & 2) << 62));
+	*cs = bits_double(rc ^ (((q + 1) & 2) << 62));
+}
+
+/**
+ * Box-muller over a block of random words, 4 words per pair of normals laid out
+ * the same way get_normals() uses them
+ */
+NORMALS_KERNEL
+static void box_muller_block(const uint32_t *words, double *out, size_t pairs) {
+	for (size_t i = 0; i < pairs; ++i) {
+		uint64_t u0i = ((uint64_t) words[4*i] << 32) | words[4*i + 1];
+		uint64_t u1i = ((uint64_t) words[4*i + 2] << 32) | words[4*i + 3];
+		// u0 in [0, 1) and u1 in (0, 1] from the top 52 bits of each
+		double u0 = bits_double((u0i >> 12) | DOUBLE_ONE_BITS) - 1.0;
+		double u1 = 2.0 - bits_double((u1i >> 12) | DOUBLE_ONE_BITS);
+		double r = sqrt(-2.0 * poly_log(u1));
+		double s, c;
+
+		poly_sincos2pi(u0, &s, &c);
+		out[2*i] = r * c;
+		out[2*i + 1] = r * s;
+	}
+}
+
+/**
+ * Random words for a block, one philox block per pair of normals. Each lane uses
+ * its own counter so the loop has no carried dependency.
+ */
+NORMALS_KERNEL
+static void fill_words(struct rng_t *rng, uint32_t *words, size_t blocks) {
+	for (size_t i = 0; i < blocks; ++i) {
+		uint32_t ctr[4] = {rng->ctr[0] + (uint32_t) i, rng->ctr[1], rng->ctr[2],
+			rng->ctr[3]};
+		rng_block(rng->key, ctr, &words[4*i]);
+	}
+}
+
+/**
+ * Fill blocks from the stream and advance its counter, splitting the fill so that
+ * fill_words never has to carry out of the low counter word
+ */
+static void fill_stream(struct rng_t *rng, uint32_t *words, size_t blocks) {
+	while (blocks > 0) {
+		// Never let a single fill wrap the low counter word
+		size_t room = (size_t) (UINT32_MAX - rng->ctr[0]) + 1;
+		size_t now = blocks < room ? blocks : room;
+
+		fill_words(rng, words, now);
+		words += 4*now;
+		blocks -= now;
+
+		rng->ctr[0] += (uint32_t) now;
+		if (rng->ctr[0] == 0)
+			rng->ctr[1] += 1;
+	}
+}
+
+/**
+ * Fill out with count independent standard normals from the calling thread's
+ * stream, a block at a time. An odd count discards the final normal of its pair.
+ */
+void get_normals_bulk(double *out, size_t count) {
+	uint32_t words[2*NORMALS_BLOCK];
+	double tail[2];
+	struct rng_t *rng = thread_rng();
+	size_t pairs;
+
+	while (count >= NORMALS_BLOCK) {
+		fill_stream(rng, words, NORMALS_BLOCK/2);
+		box_muller_block(words, out, NORMALS_BLOCK/2);
+		out += NORMALS_BLOCK;
+		count -= NORMALS_BLOCK;
+	}
+
+	pairs = count / 2;
+	if (pairs > 0) {
+		fill_stream(rng, words, pairs);
+		box_muller_block(words, out, pairs);
+		out += 2*pairs;
+	}
+
+	if (count & 1) {
+		fill_stream(rng, words, 1);
+		box_muller_block(words, tail, 1);
+		*out = tail[0];
+	}
+}
+
+/**
+ * Threshold the mixed normals for a block of patrons, with the normals for patron
+ * p at x[p*n] and the result written as the attribute byte
+ */
+NORMALS_KERNEL
+static void threshold_block(size_t n, const double *t, const double *a,
+	const double *x, uint8_t *out, size_t count)
+{
+	for (size_t p = 0; p < count; ++p) {
+		uint8_t res = 0;
+
+		for (size_t i = 0; i < n; ++i) {
+			double sum = 0.0;
+
+			for (size_t j = 0; j < n; ++j) {
+				sum += x[p*n + j] * a[i*n + j];
+			}
+
+			if (sum > t[i])
+				res |= (uint8_t) BIT(i);
+		}
+
+		out[p] = res;
+	}
+}
+
+/**
+ * Bulk form of generate_attributes(), writing count attribute bytes for the given
+ * parameters. Normals are generated a block at a time and then mixed and thresholded
+ * for every patron in the block.
+ */
+void generate_attributes_bulk(struct game_params_t *params, uint8_t *out, size_t count) {
+	size_t n = params->rng_params.n;
+	size_t per_block = NORMALS_BLOCK / n;
+	double x[NORMALS_BLOCK];
+
+	while (count > 0) {
+		size_t now = count < per_block ? count : per_block;
+
+		get_normals_bulk(x, now*n);
+		threshold_block(n, params->rng_params.t, params->rng_params.a, x, out, now);
+		out += now;
+		count -= now;
+	}
+}
+
+DEFINE_BASIC_TEST(normals_poly_accuracy, {
+	double err = 0;
+
+	for (size_t i = 1; i <= 1000; ++i) {
+		double u = i / 1000.0;
+		double s;
+		double c;
+
+		poly_sincos2pi(u - 0.0005, &s, &c);
+		err = fmax(err, fabs(poly_log(u) - log(u)));
+		err = fmax(err, fabs(s - sin(2*M_PI*(u - 0.0005))));
+		err = fmax(err, fabs(c - cos(2*M_PI*(u - 0.0005))));
+	}
+
+	TEST_EQUALS(err < 1e-14, true);
+});
@@ -0,0 +1,15 @@
+#ifndef _NORMALS_H_
+#define _NORMALS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+// Number of normals produced per inner block of the bulk generators
+#define NORMALS_BLOCK 256
+
+void get_normals_bulk(double *out, size_t count);
+void generate_attributes_bulk(struct game_params_t *params, uint8_t *out, size_t count);
+
+#endif
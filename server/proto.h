@@ -0,0 +1,94 @@
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Fixed layouts for the /bin/ routes, which take the same arguments as their JSON
+ * counterparts. This header is shared with the client so it must not depend on
+ * anything else in the server. Integers are little endian and floats are IEEE
+ * single precision, and offsets are in bytes. Errors are still sent as JSON, so a
+ * reply is only binary if it has BIN_CONTENT_TYPE.
+ */
+#define BIN_CONTENT_TYPE "application/octet-stream"
+
+// Game status
+#define BIN_RUNNING 0
+#define BIN_COMPLETED 1
+#define BIN_FAILED 2
+
+/**
+ * /bin/process-person
+ *  0 u8 status
+ *  1 u8 attributes of the next patron, only while running
+ *  2 u16 zero
+ *  4 u32 count
+ */
+#define BIN_GAME_LEN 8
+
+/**
+ * /bin/details, starting with the /bin/process-person layout
+ *  8 u32 accepted
+ * 12 u32 user id
+ * 16 u8 game type
+ * 17 u8 number of attributes n
+ * 18 u8 length of the user's name m
+ * 19 u8 zero
+ * 20 u32 accepted count for each attribute, n of them
+ *    m bytes of user name, not terminated
+ */
+#define BIN_DETAILS_LEN(n, m) (20 + 4*(n) + (m))
+
+/**
+ * /bin/symbols is the history, one byte per patron seen
+ */
+
+/**
+ * /bin/params without a type is the number of game types as a u32, and otherwise
+ *  0 u8 game type
+ *  1 u8 number of attributes n
+ *  2 u8 number of goals g
+ *  3 u8 zero
+ *  4 f32 marginals, n of them
+ *    f32 correlations, n*n of them in row order
+ *    g goals, each a u8 number of terms t followed by t u16 terms
+ */
+#define BIN_PARAMS_LEN(n) (4 + 4*(n) + 4*(n)*(n))
+
+static inline void bin_put_u16(uint8_t *buf, uint16_t val) {
+	buf[0] = val & 0xff;
+	buf[1] = val >> 8;
+}
+
+static inline void bin_put_u32(uint8_t *buf, uint32_t val) {
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = val >> 24;
+}
+
+static inline void bin_put_f32(uint8_t *buf, float val) {
+	uint32_t bits;
+
+	memcpy(&bits, &val, sizeof(bits));
+	bin_put_u32(buf, bits);
+}
+
+static inline uint16_t bin_get_u16(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8);
+}
+
+static inline uint32_t bin_get_u32(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static inline float bin_get_f32(const uint8_t *buf) {
+	uint32_t bits = bin_get_u32(buf);
+	float val;
+
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+#endif
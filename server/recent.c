@@ -0,0 +1,463 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <uuid/uuid.h>
+
+#include <libgjm/debug.h>
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "recent.h"
+#include "valkey.h"
+
+/**
+ * Spectators refresh the game lists constantly, so both are kept in memory and
+ * served without valkey. Everything that changes a game's summary in valkey also
+ * reports it here, and because count only ever grows, a summary with a lower count
+ * than the one already kept is stale and ignored. That makes updates safe to apply
+ * in any order, including loads from valkey racing with new moves.
+ *
+ * Recent games live in a ring indexed by id. Each slot is a seqlock so readers
+ * never block or write, and writers to the same slot, which are rare, spin.
+ */
+struct recent_slot {
+	uint32_t seq;
+	uint32_t id;
+	uint32_t count;
+	uint32_t accepted;
+	uint32_t type;
+	uint32_t status;
+};
+
+static struct recent_slot ring[RECENT_RING_SIZE];
+static uint32_t ring_last;
+
+/**
+ * A user's most recent games, newest first like the list in valkey. An entry is
+ * made before its games are loaded so that no update is missed meanwhile, and it
+ * is only used for replies once filled.
+ */
+struct recent_user {
+	struct user_t user;
+	bool used;
+	bool filled;
+	uint64_t last_used;
+	size_t n;
+	struct game_summary games[VALKEY_USER_GAME_HISTORY];
+};
+
+struct user_shard {
+	pthread_mutex_t lock;
+	struct recent_user users[RECENT_USER_SHARD_SIZE];
+};
+
+static struct user_shard user_shards[RECENT_USER_SHARDS];
+static uint64_t user_clock;
+
+static bool summary_newer(struct game_summary *a, struct game_summary *b) {
+	if (a->count != b->count)
+		return a->count > b->count;
+	return a->status != GAME_RUNNING && b->status == GAME_RUNNING;
+}
+
+static void slot_write(struct recent_slot *slot, struct game_summary *summary) {
+	struct game_summary current;
+	uint32_t seq;
+
+	while (true) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (!(seq & 1) && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// A newer game may already have the slot, or this may be an old update
+	current.id = __atomic_load_n(&slot->id, __ATOMIC_RELAXED);
+	current.count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+	current.status = __atomic_load_n(&slot->status, __ATOMIC_RELAXED);
+
+	if (summary->id > current.id ||
+		(summary->id == current.id && summary_newer(summary, &current)))
+	{
+		__atomic_store_n(&slot->id, summary->id, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->count, summary->count, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->accepted, summary->accepted, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->type, summary->type, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->status, summary->status, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void slot_read(struct recent_slot *slot, struct game_summary *out) {
+	uint32_t before, after;
+
+	while (true) {
+		before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+
+		out->id = __atomic_load_n(&slot->id, __ATOMIC_RELAXED);
+		out->count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+		out->accepted = __atomic_load_n(&slot->accepted, __ATOMIC_RELAXED);
+		out->type = __atomic_load_n(&slot->type, __ATOMIC_RELAXED);
+		out->status = __atomic_load_n(&slot->status, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (before == after)
+			return;
+	}
+}
+
+static void ring_update(struct game_summary *summary) {
+	uint32_t last;
+
+	slot_write(&ring[summary->id % RECENT_RING_SIZE], summary);
+
+	// Only advertise a new game once its slot is written
+	last = __atomic_load_n(&ring_last, __ATOMIC_RELAXED);
+	while (summary->id > last) {
+		if (__atomic_compare_exchange_n(&ring_last, &last, summary->id, false,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * Keep a summary in a user's list, in id order and dropping the oldest if full
+ */
+static void user_merge(struct recent_user *entry, struct game_summary *summary) {
+	size_t i = 0;
+
+	while (i < entry->n && entry->games[i].id > summary->id)
+		i += 1;
+
+	if (i < entry->n && entry->games[i].id == summary->id) {
+		if (summary_newer(summary, &entry->games[i]))
+			entry->games[i] = *summary;
+		return;
+	}
+
+	if (i == ARRAY_SIZE(entry->games))
+		return;
+
+	if (entry->n == ARRAY_SIZE(entry->games))
+		entry->n -= 1;
+
+	memmove(&entry->games[i + 1], &entry->games[i],
+		(entry->n - i) * sizeof(entry->games[0]));
+	entry->games[i] = *summary;
+	entry->n += 1;
+}
+
+static struct user_shard *get_user_shard(uint32_t userid) {
+	return &user_shards[userid % RECENT_USER_SHARDS];
+}
+
+static struct recent_user *shard_find(struct user_shard *shard, uint32_t userid) {
+	for (size_t i = 0; i < RECENT_USER_SHARD_SIZE; ++i) {
+		if (shard->users[i].used && shard->users[i].user.id == userid)
+			return &shard->users[i];
+	}
+	return NULL;
+}
+
+/**
+ * Game creation and every commit report the game's new summary here
+ */
+void recent_update(struct game_t *game) {
+	struct game_summary summary;
+	struct user_shard *shard = get_user_shard(game->userid);
+	struct recent_user *entry;
+
+	summarize_game(game, &summary);
+	ring_update(&summary);
+
+	pthread_mutex_lock(&shard->lock);
+	entry = shard_find(shard, game->userid);
+	if (entry)
+		user_merge(entry, &summary);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Fill in the games /recent-games lists, newest first. As always, the list ends
+ * with the game before the last one within the limit, which for a young database
+ * is the nonexistent game 0.
+ */
+size_t recent_games(struct game_summary out[RECENT_RING_SIZE]) {
+	uint32_t last = __atomic_load_n(&ring_last, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+	uint32_t i;
+
+	if (last == 0)
+		return 0;
+
+	for (i = 0; i < RECENT_GAME_LIMIT && last - i >= 1; ++i) {
+		out[n++].id = last - i;
+	}
+	out[n++].id = last - i;
+
+	for (i = 0; i < n; ++i) {
+		struct game_summary slot;
+
+		slot_read(&ring[out[i].id % RECENT_RING_SIZE], &slot);
+		if (slot.id == out[i].id && slot.id != 0) {
+			out[i] = slot;
+			out[i].found = true;
+		}
+		else {
+			out[i].found = false;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Match a user the same way find_user_by_string() does, by uuid and then by name.
+ * Its last resort of an id is left out, because only valkey can say that no user
+ * has that name, and names may be all digits.
+ */
+static bool user_matches(struct user_t *user, const char *str, int pass) {
+	if (pass == 0)
+		return strcasecmp(user->name, str) == 0;
+	return STRING_EQUALS(user->realname, str);
+}
+
+/**
+ * Copy out the games of a kept user, with the shard locked, if they have been filled
+ */
+static bool copy_user_games(struct recent_user *entry, struct game_summary *out,
+	size_t *n)
+{
+	if (!entry->filled)
+		return false;
+
+	entry->last_used = __atomic_add_fetch(&user_clock, 1, __ATOMIC_RELAXED);
+	memcpy(out, entry->games, entry->n * sizeof(*out));
+	*n = entry->n;
+	return true;
+}
+
+/**
+ * Copy out a user's games if they are kept, with the user given as a uuid or a name
+ * for /user-games. A user given by id has to be found in valkey first, and then
+ * their games can be had from recent_user_games_by_id().
+ */
+bool recent_user_games(const char *str, struct game_summary *out, size_t *n) {
+	uuid_t uuid;
+	bool found;
+	int pass = 0;
+
+	if (uuid_parse(str, uuid) < 0)
+		pass = 1;
+
+	for (; pass < 2; ++pass) {
+		for (size_t s = 0; s < RECENT_USER_SHARDS; ++s) {
+			struct user_shard *shard = &user_shards[s];
+
+			pthread_mutex_lock(&shard->lock);
+			for (size_t i = 0; i < RECENT_USER_SHARD_SIZE; ++i) {
+				struct recent_user *entry = &shard->users[i];
+
+				if (!entry->used || !user_matches(&entry->user, str, pass))
+					continue;
+
+				found = copy_user_games(entry, out, n);
+				pthread_mutex_unlock(&shard->lock);
+				return found;
+			}
+			pthread_mutex_unlock(&shard->lock);
+		}
+
+		// A uuid only ever matches a uuid
+		if (pass == 0)
+			return false;
+	}
+
+	return false;
+}
+
+bool recent_user_games_by_id(uint32_t userid, struct game_summary *out, size_t *n) {
+	struct user_shard *shard = get_user_shard(userid);
+	struct recent_user *entry;
+	bool found = false;
+
+	pthread_mutex_lock(&shard->lock);
+	entry = shard_find(shard, userid);
+	if (entry)
+		found = copy_user_games(entry, out, n);
+	pthread_mutex_unlock(&shard->lock);
+
+	return found;
+}
+
+/**
+ * Start keeping a user's games, before they are read from valkey, evicting the
+ * least recently used user in the shard if needed
+ */
+void recent_user_track(struct user_t *user) {
+	struct user_shard *shard = get_user_shard(user->id);
+	struct recent_user *entry;
+
+	pthread_mutex_lock(&shard->lock);
+
+	entry = shard_find(shard, user->id);
+	if (!entry) {
+		entry = &shard->users[0];
+		for (size_t i = 0; i < RECENT_USER_SHARD_SIZE; ++i) {
+			struct recent_user *e = &shard->users[i];
+
+			if (!e->used) {
+				entry = e;
+				break;
+			}
+
+			if (e->last_used < entry->last_used)
+				entry = e;
+		}
+
+		memset(entry, 0, sizeof(*entry));
+		entry->user = *user;
+		entry->used = true;
+		entry->last_used = __atomic_add_fetch(&user_clock, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Merge in a user's games as read from valkey, after recent_user_track()
+ */
+void recent_user_fill(struct user_t *user, struct game_summary *games, size_t n) {
+	struct user_shard *shard = get_user_shard(user->id);
+	struct recent_user *entry;
+
+	pthread_mutex_lock(&shard->lock);
+
+	// Evicted while we were reading, so the next request starts over
+	entry = shard_find(shard, user->id);
+	if (entry) {
+		for (size_t i = 0; i < n; ++i) {
+			if (games[i].found)
+				user_merge(entry, &games[i]);
+		}
+		entry->filled = true;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Warm the ring with the games /recent-games would list from valkey
+ */
+error_t *init_recent(void) {
+	struct game_summary games[RECENT_RING_SIZE] = {0};
+	valkeyReply *reply;
+	error_t *ret;
+	uint32_t last;
+	size_t n = 0;
+
+	for (size_t i = 0; i < RECENT_USER_SHARDS; ++i)
+		pthread_mutex_init(&user_shards[i].lock, NULL);
+
+	ret = valkey_read(&reply, "GET next_game");
+	if (NOT_OK(ret))
+		return ret;
+
+	last = reply->str ? atoi(reply->str) : 0;
+	freeReplyObject(reply);
+
+	for (uint32_t id = last; id >= 1 && n < ARRAY_SIZE(games); --id) {
+		games[n++].id = id;
+	}
+
+	ret = find_game_summaries(games, n);
+	if (NOT_OK(ret))
+		return ret;
+
+	for (size_t i = 0; i < n; ++i) {
+		if (games[i].found)
+			slot_write(&ring[games[i].id % RECENT_RING_SIZE], &games[i]);
+	}
+
+	__atomic_store_n(&ring_last, last, __ATOMIC_RELEASE);
+	DEBUG("recent games warmed up to game %u\n", last);
+	return OK;
+}
+
+DEFINE_BASIC_TEST(recent_user_merge_order, {
+	struct recent_user entry = {0};
+	struct game_summary s = {0};
+
+	// Out of order arrivals still end up newest first
+	s.id = 5;
+	user_merge(&entry, &s);
+	s.id = 9;
+	user_merge(&entry, &s);
+	s.id = 7;
+	user_merge(&entry, &s);
+	TEST_EQUALS(entry.n, 3);
+	TEST_EQUALS(entry.games[0].id, 9);
+	TEST_EQUALS(entry.games[1].id, 7);
+	TEST_EQUALS(entry.games[2].id, 5);
+
+	// A stale summary does not replace a newer one
+	s.count = 10;
+	user_merge(&entry, &s);
+	s.count = 4;
+	user_merge(&entry, &s);
+	TEST_EQUALS(entry.n, 3);
+	TEST_EQUALS(entry.games[1].count, 10);
+
+	// Once full the oldest game drops out, and older games are not added
+	for (uint32_t id = 100; id < 100 + VALKEY_USER_GAME_HISTORY; ++id) {
+		s.id = id;
+		user_merge(&entry, &s);
+	}
+	TEST_EQUALS(entry.n, VALKEY_USER_GAME_HISTORY);
+	TEST_EQUALS(entry.games[VALKEY_USER_GAME_HISTORY - 1].id, 100);
+
+	s.id = 1;
+	user_merge(&entry, &s);
+	TEST_EQUALS(entry.games[VALKEY_USER_GAME_HISTORY - 1].id, 100);
+});
+
+DEFINE_BASIC_TEST(recent_user_numeric_name, {
+	struct user_t by_id = { .realname = "alice", .id = 123 };
+	struct user_t by_name = { .realname = "123", .id = 5 };
+	struct game_summary games[2] = {
+		{ .id = 11, .found = true },
+		{ .id = 12, .found = true },
+	};
+	struct game_summary out[VALKEY_USER_GAME_HISTORY];
+	size_t n = 0;
+
+	recent_user_track(&by_id);
+	recent_user_fill(&by_id, &games[0], 1);
+
+	// User 123 is kept, but someone who is not may be named 123
+	TEST_EQUALS(recent_user_games("123", out, &n), false);
+	TEST_EQUALS(recent_user_games_by_id(123, out, &n), true);
+	TEST_EQUALS(n, 1);
+	TEST_EQUALS(out[0].id, 11);
+
+	// Once the user named 123 is kept, their games are the ones given for 123
+	recent_user_track(&by_name);
+	recent_user_fill(&by_name, &games[1], 1);
+	TEST_EQUALS(recent_user_games("123", out, &n), true);
+	TEST_EQUALS(n, 1);
+	TEST_EQUALS(out[0].id, 12);
+	TEST_EQUALS(recent_user_games("alice", out, &n), true);
+	TEST_EQUALS(out[0].id, 11);
+
+	memset(user_shards, 0, sizeof(user_shards));
+});
@@ -0,0 +1,28 @@
+#ifndef _RECENT_H_
+#define _RECENT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libgjm/errors.h>
+
+#include "game.h"
+
+// Slots in the ring of recent games, enough for everything /recent-games lists
+#define RECENT_RING_SIZE (RECENT_GAME_LIMIT + 1)
+
+// Users whose game lists are kept, spread over shards by user id
+#define RECENT_USER_SHARDS 16
+#define RECENT_USER_SHARD_SIZE 64
+
+error_t *init_recent(void);
+void recent_update(struct game_t *game);
+
+size_t recent_games(struct game_summary out[RECENT_RING_SIZE]);
+
+bool recent_user_games(const char *str, struct game_summary *out, size_t *n);
+bool recent_user_games_by_id(uint32_t userid, struct game_summary *out, size_t *n);
+void recent_user_track(struct user_t *user);
+void recent_user_fill(struct user_t *user, struct game_summary *games, size_t n);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include <libgjm/errors.h>
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "rng.h"
+
+// Seed shared by all streams, each thread gets its own stream id under this seed
+static uint64_t rng_master_seed = 0;
+static uint64_t rng_next_stream = 0;
+
+// Key for the seeds the server picks for games, which never leaves the process
+static uint32_t rng_secret[2];
+
+static __thread struct rng_t local_rng;
+static __thread bool local_rng_ready = false;
+
+/**
+ * Pick the process wide seed. Streams are separated by their counter space rather
+ * than by the seed so this only has to differ between runs
+ */
+error_t *init_rng(void) {
+	uint64_t seed;
+
+	if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+		DEBUG("getrandom failed, seeding rng from the clock\n");
+		seed = (uint64_t) time(NULL) * PHILOX_W0;
+	}
+
+	rng_master_seed = seed;
+
+	if (getrandom(rng_secret, sizeof(rng_secret), 0) != sizeof(rng_secret)) {
+		DEBUG("getrandom failed, deriving the seed key from the clock\n");
+		rng_secret[0] = (uint32_t) clock() * PHILOX_W1;
+		rng_secret[1] = (uint32_t) (seed >> 32) ^ PHILOX_M1;
+	}
+
+	return OK;
+}
+
+/**
+ * The key holds the seed and the high half of the counter holds the stream, so
+ * every (seed, stream) pair owns 2^64 blocks that no other stream can reach
+ */
+void rng_seed(struct rng_t *rng, uint64_t seed, uint64_t stream) {
+	rng->key[0] = (uint32_t) seed;
+	rng->key[1] = (uint32_t) (seed >> 32);
+	rng->ctr[0] = 0;
+	rng->ctr[1] = 0;
+	rng->ctr[2] = (uint32_t) stream;
+	rng->ctr[3] = (uint32_t) (stream >> 32);
+}
+
+/**
+ * Produce the next block from this stream and advance the (low 64 bit) counter
+ */
+void rng_next(struct rng_t *rng, uint32_t out[4]) {
+	rng_block(rng->key, rng->ctr, out);
+
+	rng->ctr[0] += 1;
+	if (rng->ctr[0] == 0)
+		rng->ctr[1] += 1;
+}
+
+/**
+ * Stream for the calling thread, assigned the first time a thread asks for one so
+ * that threads created by MHD need no extra setup. Never shared, so no locking.
+ */
+struct rng_t *thread_rng(void) {
+	if (!local_rng_ready) {
+		uint64_t stream = __atomic_fetch_add(&rng_next_stream, 1, __ATOMIC_RELAXED);
+		rng_seed(&local_rng, rng_master_seed, stream);
+		local_rng_ready = true;
+	}
+
+	return &local_rng;
+}
+
+/**
+ * A seed for a game that clients cannot predict, a draw from the calling thread's
+ * stream encrypted under the process secret
+ */
+uint64_t rng_private_seed(void) {
+	uint32_t draw[RNG_BLOCK_WORDS];
+	uint32_t out[RNG_BLOCK_WORDS];
+
+	rng_next(thread_rng(), draw);
+	rng_block(rng_secret, draw, out);
+	return ((uint64_t) out[1] << 32) | out[0];
+}
+
+// Known answer vectors from the Random123 distribution
+DEFINE_BASIC_TEST(rng_philox_kat, {
+	uint32_t out[4];
+
+	rng_block((uint32_t[]) {0, 0}, (uint32_t[]) {0, 0, 0, 0}, out);
+	TEST_EQUALS(out[0], 0x6627e8d5);
+	TEST_EQUALS(out[1], 0xe169c58d);
+	TEST_EQUALS(out[2], 0xbc57ac4c);
+	TEST_EQUALS(out[3], 0x9b00dbd8);
+
+	rng_block((uint32_t[]) {0xa4093822, 0x299f31d0},
+		(uint32_t[]) {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, out);
+	TEST_EQUALS(out[0], 0xd16cfe09);
+	TEST_EQUALS(out[1], 0x94fdcceb);
+	TEST_EQUALS(out[2], 0x5001e420);
+	TEST_EQUALS(out[3], 0x24126ea1);
+});
@@ -0,0 +1,69 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libgjm/errors.h>
+
+// Number of 32 bit words produced per block of the generator
+#define RNG_BLOCK_WORDS 4
+
+// Philox4x32 multipliers and Weyl key increments
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+#define PHILOX_ROUNDS 10
+
+/**
+ * Philox4x32-10 counter based stream. Blocks are produced by encrypting a counter
+ * under the key, which is the seed. The low 64 bits of the counter advance with
+ * each block and the high 64 bits hold the stream number, so thread streams all
+ * share the master seed and are kept apart by their stream numbers, never
+ * overlapping and needing no shared state between threads.
+ */
+struct rng_t {
+	uint32_t key[2];
+	uint32_t ctr[4];
+};
+
+error_t *init_rng(void);
+
+void rng_seed(struct rng_t *rng, uint64_t seed, uint64_t stream);
+void rng_next(struct rng_t *rng, uint32_t out[4]);
+struct rng_t *thread_rng(void);
+uint64_t rng_private_seed(void);
+
+/**
+ * One block of the generator, inline so that bulk generators can vectorize it
+ */
+static inline void rng_block(const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4]) {
+	uint32_t k0 = key[0];
+	uint32_t k1 = key[1];
+	uint32_t c0 = ctr[0];
+	uint32_t c1 = ctr[1];
+	uint32_t c2 = ctr[2];
+	uint32_t c3 = ctr[3];
+
+	#pragma GCC unroll 10
+	for (size_t i = 0; i < PHILOX_ROUNDS; ++i) {
+		uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+
+		c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t) p1;
+		c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t) p0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+#endif
@@ -3,7 +3,7 @@
 
 local-ldflags = -lm -lmicrohttpd -luuid libvalkey/lib/libvalkey.a
 
-src := goal.c game.c valkey.c
+src := async.c cache.c dist.c goal.c game.c history.c normals.c recent.c rng.c stream.c symbols.c valkey.c
 
 src-berghain-server-y := $(src) main.c
 inc-y += ../libvalkey/include
@@ -14,6 +14,10 @@ src-check-y := $(src) check.c
 check-ldflags-y = $(LDFLAGS_LIBGJM) $(local-ldflags)
 apps-y += check
 
+src-bench-y := $(src) bench.c
+bench-ldflags-y = $(LDFLAGS_LIBGJM) $(local-ldflags)
+apps-y += bench
+
 src-server-test-y := $(src) ../$(TESTDRIVER_LIBGJM)
 server-test-ldflags-y = $(local-ldflags)
 apps-y += server-test
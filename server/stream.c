@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <libgjm/debug.h>
+#include <libgjm/errors.h>
+#include <libgjm/util.h>
+
+#include "game.h"
+#include "stream.h"
+
+/**
+ * A game session on an upgraded connection. Each session has its own thread doing
+ * blocking reads on the socket, and the game stays pinned in the cache between
+ * moves so that a move costs one round trip and one script run.
+ */
+struct stream {
+	uuid_t gameid;
+	MHD_socket sock;
+	struct MHD_UpgradeResponseHandle *urh;
+	// Anything the client sent after its request, before it saw our reply
+	uint8_t *extra;
+	size_t extra_len;
+};
+
+static bool stream_send(struct stream *s, uint8_t frame) {
+	ssize_t ret;
+
+	do {
+		ret = send(s->sock, &frame, 1, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret == 1;
+}
+
+static bool stream_recv(struct stream *s, uint8_t *frame) {
+	ssize_t ret;
+
+	if (s->extra_len > 0) {
+		*frame = *s->extra;
+		s->extra += 1;
+		s->extra_len -= 1;
+		return true;
+	}
+
+	do {
+		ret = recv(s->sock, frame, 1, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret == 1;
+}
+
+/**
+ * The frame describing where a game stands, either the next patron or how it ended
+ */
+static uint8_t stream_frame(struct game_t *game) {
+	if (!game_is_finished(game))
+		return game->next;
+
+	if (game->goals_satisfied)
+		return STREAM_END | STREAM_COMPLETED;
+	return STREAM_END | STREAM_FAILED;
+}
+
+static void *stream_session(void *arg) {
+	struct stream *s = arg;
+	struct timeval idle = { .tv_sec = STREAM_IDLE_SECONDS };
+	struct game_t game = {0};
+	uint8_t *extra = s->extra;
+	uint8_t frame;
+	int one = 1;
+	error_t *ret;
+
+	setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(s->sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+	ret = find_game(s->gameid, &game);
+	if (NOT_OK(ret))
+		goto handle_error;
+
+	frame = stream_frame(&game);
+	park_game(&game);
+
+	while (stream_send(s, frame) && !(frame & STREAM_END)) {
+		if (!stream_recv(s, &frame))
+			break;
+
+		ret = unpark_game(&game);
+		if (NOT_OK(ret))
+			goto handle_error;
+
+		if (frame != STREAM_ACCEPT && frame != STREAM_REJECT) {
+			ret = E_MSG("bad verdict frame");
+			goto handle_error;
+		}
+
+		ret = process_next_person(&game, frame == STREAM_ACCEPT);
+		if (NOT_OK(ret))
+			goto handle_error;
+
+		frame = stream_frame(&game);
+		park_game(&game);
+	}
+
+	// Parked, so pick it up again just to let go of it
+	ret = unpark_game(&game);
+	if (NOT_OK(ret))
+		goto handle_error;
+
+	goto out;
+
+handle_error:
+	DEBUG("stream session failed:");
+	INDENT(2);
+	error_print(ret);
+	UNDENT(2);
+	error_free(ret);
+	stream_send(s, STREAM_END | STREAM_ERROR);
+
+out:
+	release_game(&game);
+	MHD_upgrade_action(s->urh, MHD_UPGRADE_ACTION_CLOSE);
+	free(extra);
+	free(s);
+	return NULL;
+}
+
+static void stream_upgrade(void *cls, struct MHD_Connection *conn, void *state,
+	const char *extra_in, size_t extra_in_size, MHD_socket sock,
+	struct MHD_UpgradeResponseHandle *urh)
+{
+	struct stream *s = cls;
+	pthread_t thread;
+
+	UNUSED(conn);
+	UNUSED(state);
+
+	s->sock = sock;
+	s->urh = urh;
+
+	if (extra_in_size > 0) {
+		s->extra = malloc(extra_in_size);
+		if (!s->extra)
+			goto handle_error;
+		memcpy(s->extra, extra_in, extra_in_size);
+		s->extra_len = extra_in_size;
+	}
+
+	if (pthread_create(&thread, NULL, stream_session, s) != 0)
+		goto handle_error;
+
+	pthread_detach(thread);
+	return;
+
+handle_error:
+	ERROR("failed to start stream session\n");
+	MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+	free(s->extra);
+	free(s);
+}
+
+/**
+ * The reply that switches a connection over to a session for the given game. The
+ * game itself is only looked up by the session, so that its cache entry is locked
+ * and unlocked by the same thread.
+ */
+struct MHD_Response *stream_response(const uuid_t gameid) {
+	struct MHD_Response *resp;
+	struct stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	uuid_copy(s->gameid, gameid);
+
+	resp = MHD_create_response_for_upgrade(stream_upgrade, s);
+	if (!resp) {
+		free(s);
+		return NULL;
+	}
+
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_UPGRADE, STREAM_PROTOCOL);
+	return resp;
+}
@@ -0,0 +1,28 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <microhttpd.h>
+#include <uuid/uuid.h>
+
+// Value of the Upgrade header that switches a connection to a game session
+#define STREAM_PROTOCOL "berghain-stream"
+
+// A session that hears nothing from its client for this long is closed
+#define STREAM_IDLE_SECONDS 60
+
+/**
+ * Once upgraded the connection carries single byte frames. The server sends the
+ * attributes of the pending patron, the client answers with a verdict byte, and so
+ * on until the server sends a final byte with STREAM_END set and closes the session.
+ */
+#define STREAM_REJECT 0
+#define STREAM_ACCEPT 1
+
+#define STREAM_END 0x80
+#define STREAM_COMPLETED 0
+#define STREAM_FAILED 1
+#define STREAM_ERROR 2
+
+struct MHD_Response *stream_response(const uuid_t gameid);
+
+#endif
@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uuid/uuid.h>
+
+#include <libgjm/debug.h>
+#include <libgjm/test.h>
+#include <libgjm/util.h>
+
+#include "symbols.h"
+
+/**
+ * The history of a finished game never changes, so its replies are built once and
+ * kept. MHD counts references to a response, so the cache holds the one from its
+ * creation and any number of connections can be sending it at the same time.
+ */
+struct symbols_entry {
+	uuid_t id;
+	uint32_t gameid;
+	uint64_t last_used;
+	// Indexed by whether the reply is binary
+	struct MHD_Response *resp[2];
+};
+
+static pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct symbols_entry symbols_cache[SYMBOLS_CACHE_SIZE];
+static uint64_t symbols_clock;
+
+static size_t symbol_digits(uint8_t sym) {
+	if (sym >= 100)
+		return 3;
+	if (sym >= 10)
+		return 2;
+	return 1;
+}
+
+/**
+ * Render a history as the /symbols json into a buffer of exactly the right size,
+ * which the caller frees
+ */
+char *format_symbols(const uint8_t *seen, uint32_t count, size_t *len) {
+	char head[64];
+	size_t headlen;
+	size_t pos;
+	size_t n;
+	char *buf;
+
+	headlen = snprintf(head, sizeof(head), "{\"count\":%u,\"symbols\":[", count);
+
+	// Each symbol has a comma before it except the first, then the closing ]}
+	n = headlen + 2;
+	for (uint32_t i = 0; i < count; ++i) {
+		n += symbol_digits(seen[i]) + (i > 0);
+	}
+
+	buf = malloc(n + 1);
+	if (!buf)
+		return NULL;
+
+	memcpy(buf, head, headlen);
+	pos = headlen;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		uint8_t sym = seen[i];
+
+		if (i > 0)
+			buf[pos++] = ',';
+		if (sym >= 100)
+			buf[pos++] = '0' + sym / 100;
+		if (sym >= 10)
+			buf[pos++] = '0' + (sym / 10) % 10;
+		buf[pos++] = '0' + sym % 10;
+	}
+
+	buf[pos++] = ']';
+	buf[pos++] = '}';
+	buf[pos] = '\0';
+
+	*len = pos;
+	return buf;
+}
+
+/**
+ * Find a game by the same argument /symbols takes, either its uuid or its id
+ */
+static struct symbols_entry *symbols_find(const char *game_arg) {
+	uuid_t id;
+	uint32_t gameid = 0;
+	bool by_uuid;
+
+	by_uuid = uuid_parse(game_arg, id) == 0;
+	if (!by_uuid)
+		gameid = atoi(game_arg);
+
+	for (size_t i = 0; i < SYMBOLS_CACHE_SIZE; ++i) {
+		struct symbols_entry *entry = &symbols_cache[i];
+
+		if (entry->gameid == 0)
+			continue;
+
+		if (by_uuid ? uuid_compare(entry->id, id) == 0 : entry->gameid == gameid)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue the kept reply for a game if there is one, with the lock held so that it
+ * cannot be evicted before MHD takes its own reference
+ */
+bool symbols_cache_queue(struct MHD_Connection *conn, const char *game_arg, bool bin,
+	enum MHD_Result *ret)
+{
+	struct symbols_entry *entry;
+
+	pthread_mutex_lock(&symbols_lock);
+
+	entry = symbols_find(game_arg);
+	if (!entry || !entry->resp[bin]) {
+		pthread_mutex_unlock(&symbols_lock);
+		return false;
+	}
+
+	entry->last_used = ++symbols_clock;
+	*ret = MHD_queue_response(conn, MHD_HTTP_OK, entry->resp[bin]);
+
+	pthread_mutex_unlock(&symbols_lock);
+	return true;
+}
+
+/**
+ * Keep the reply for a finished game, taking over the caller's reference to it.
+ * The least recently used game makes room if needed.
+ */
+void symbols_cache_add(struct game_t *game, bool bin, struct MHD_Response *resp) {
+	struct symbols_entry *entry;
+
+	ASSERT(game_is_finished(game));
+
+	pthread_mutex_lock(&symbols_lock);
+
+	entry = symbols_find(game->name);
+	if (!entry) {
+		entry = &symbols_cache[0];
+		for (size_t i = 1; i < SYMBOLS_CACHE_SIZE; ++i) {
+			if (symbols_cache[i].last_used < entry->last_used)
+				entry = &symbols_cache[i];
+		}
+
+		for (size_t i = 0; i < ARRAY_SIZE(entry->resp); ++i) {
+			if (entry->resp[i])
+				MHD_destroy_response(entry->resp[i]);
+			entry->resp[i] = NULL;
+		}
+
+		uuid_parse(game->name, entry->id);
+		entry->gameid = game->id;
+	}
+
+	// Another request may have got here first with the same reply
+	if (entry->resp[bin])
+		MHD_destroy_response(entry->resp[bin]);
+
+	entry->resp[bin] = resp;
+	entry->last_used = ++symbols_clock;
+
+	pthread_mutex_unlock(&symbols_lock);
+}
+
+DEFINE_BASIC_TEST(format_symbols_exact, {
+	uint8_t seen[] = {0, 9, 10, 99, 100, 255};
+	size_t len;
+	char *buf;
+
+	buf = format_symbols(seen, ARRAY_SIZE(seen), &len);
+	TEST_EQUALS(strcmp(buf, "{\"count\":6,\"symbols\":[0,9,10,99,100,255]}"), 0);
+	TEST_EQUALS(len, strlen(buf));
+	free(buf);
+
+	buf = format_symbols(NULL, 0, &len);
+	TEST_EQUALS(strcmp(buf, "{\"count\":0,\"symbols\":[]}"), 0);
+	TEST_EQUALS(len, strlen(buf));
+	free(buf);
+});
@@ -0,0 +1,19 @@
+#ifndef _SYMBOLS_H_
+#define _SYMBOLS_H_
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+// Finished games whose /symbols replies are kept, in each format
+#define SYMBOLS_CACHE_SIZE 256
+
+char *format_symbols(const uint8_t *seen, uint32_t count, size_t *len);
+
+bool symbols_cache_queue(struct MHD_Connection *conn, const char *game_arg, bool bin,
+	enum MHD_Result *ret);
+void symbols_cache_add(struct game_t *game, bool bin, struct MHD_Response *resp);
+
+#endif
@@ -1,17 +1,54 @@
-#include <sched.h>
-#include <libgjm/memory.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "valkey.h"
 
 DEFINE_ERROR_MESSAGE(ERROR_ID_VALKEY, "valkey error");
+DEFINE_ERROR_MESSAGE(ERROR_ID_VALKEY_BUSY, "valkey pool busy");
 
+/**
+ * A thread waiting for a connection. Waiters queue in arrival order and
+ * release_valkey() hands a connection straight to the oldest one, so a thread that
+ * arrives later can never take it first.
+ */
+struct pool_waiter {
+	pthread_cond_t cond;
+	struct valkey_t *vk;
+	struct pool_waiter *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct valkey_t *vk_list = NULL;
+static struct pool_waiter *wait_head = NULL;
+static struct pool_waiter *wait_tail = NULL;
+
+static size_t pool_size = VALKEY_POOL_SIZE;
+static unsigned int pool_timeout_ms = VALKEY_POOL_TIMEOUT_MS;
+static struct valkey_pool_stats pool_stats;
+
+/**
+ * Set the number of connections, only before init_valkey()
+ */
+void valkey_set_pool_size(size_t size) {
+	pool_size = size;
+}
+
+/**
+ * Set how long get_valkey() waits for a connection before giving up
+ */
+void valkey_set_pool_timeout(unsigned int ms) {
+	pool_timeout_ms = ms;
+}
 
 /**
  * Unlocked single threaded pool initializer
  */
 error_t *init_valkey(void) {
-	for (size_t i = 0; i < VALKEY_POOL_SIZE; ++i) {
+	for (size_t i = 0; i < pool_size; ++i) {
 		struct valkey_t *vk = calloc(1, sizeof(*vk));
 
 		vk->ctx = valkeyConnectUnix(VALKEY_SOCKET_PATH);
@@ -24,35 +61,439 @@ error_t *init_valkey(void) {
 		vk->next = vk_list;
 		vk_list = vk;
 	}
+
+	pool_stats.size = pool_size;
 	return OK;
 }
 
+static uint64_t now_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static uint64_t elapsed_us(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Count a checkout, with the pool locked
+ */
+static void record_checkout(uint64_t waited_us) {
+	size_t bucket = 0;
+
+	while (waited_us > 0 && bucket < VALKEY_WAIT_BUCKETS - 1) {
+		waited_us >>= 1;
+		bucket += 1;
+	}
+
+	pool_stats.checkouts += 1;
+	pool_stats.in_use += 1;
+	pool_stats.wait[bucket] += 1;
+}
+
+/**
+ * Make a connection usable before handing it out. Connections that have been idle a
+ * while get a PING first, since valkey may have restarted since they were last used,
+ * and a connection with an error is reconnected. Reconnects that fail back off so
+ * that a valkey outage does not turn every request into a connect attempt, and in
+ * the meantime requests fail quickly on the broken connection.
+ */
+static void check_connection(struct valkey_t *vk) {
+	uint64_t now = now_ms();
+	uint64_t backoff;
+	valkeyReply *reply;
+
+	if (!vk->ctx->err && now - vk->last_used > VALKEY_IDLE_CHECK_MS) {
+		reply = valkeyCommand(vk->ctx, "PING");
+		freeReplyObject(reply);
+	}
+
+	vk->last_used = now;
+	if (!vk->ctx->err || now < vk->retry_at)
+		return;
+
+	if (valkeyReconnect(vk->ctx) == VALKEY_OK) {
+		DEBUG("reconnected to valkey after %u failures\n", vk->failures);
+		vk->failures = 0;
+		vk->retry_at = 0;
+
+		pthread_mutex_lock(&pool_lock);
+		pool_stats.reconnects += 1;
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+
+	backoff = VALKEY_BACKOFF_MIN_MS << (vk->failures < 7 ? vk->failures : 7);
+	if (backoff > VALKEY_BACKOFF_MAX_MS)
+		backoff = VALKEY_BACKOFF_MAX_MS;
+
+	vk->failures += 1;
+	vk->retry_at = now + backoff;
+	DEBUG("failed to reconnect to valkey: %s, next attempt in %lums\n",
+		vk->ctx->errstr, backoff);
+}
+
+static void remove_waiter(struct pool_waiter *waiter) {
+	struct pool_waiter **link = &wait_head;
+	struct pool_waiter *prev = NULL;
+
+	while (*link && *link != waiter) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+
+	if (!*link)
+		return;
+
+	*link = waiter->next;
+	if (wait_tail == waiter)
+		wait_tail = prev;
+}
+
 /**
- * No bounded waits or fair scheduling, rewrite with pthread primitives instead.
- * Originally this was just going to be a basic lock free version but with valkey
- * accesses happening another thread could take a while so sched_yield was added
- * to allow the actual thread in question to make progress, but if we're out of
- * connections in the pool and several new request threads pile up one of them could
- * just get starved arbitrarily long
+ * Take a connection from the pool, waiting in line for one if they are all in use.
+ * Returns NULL if none came free within the pool timeout, which callers report
+ * with E_VALKEY_BUSY.
  */
 struct valkey_t *get_valkey(void) {
+	struct pool_waiter waiter = {0};
+	struct timespec start, deadline;
+	pthread_condattr_t attr;
 	struct valkey_t *ret;
+	int err = 0;
 
-	do {
-		ret = NULL;
-		while (!ret) {
-			ret = READ_RELAXED(&vk_list);
-			if (!ret)
-				sched_yield();
-		}
-	} while (!CAS_RELAXED(&vk_list, ret, vk_list->next));
+	pthread_mutex_lock(&pool_lock);
+
+	// Only take a free connection directly if nobody is queued ahead of us
+	if (vk_list && !wait_head) {
+		ret = vk_list;
+		vk_list = ret->next;
+		record_checkout(0);
+		pthread_mutex_unlock(&pool_lock);
+		check_connection(ret);
+		return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline.tv_sec = start.tv_sec + pool_timeout_ms / 1000;
+	deadline.tv_nsec = start.tv_nsec + (pool_timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&waiter.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (wait_tail)
+		wait_tail->next = &waiter;
+	else
+		wait_head = &waiter;
+	wait_tail = &waiter;
+	pool_stats.waiting += 1;
+
+	while (!waiter.vk && err != ETIMEDOUT)
+		err = pthread_cond_timedwait(&waiter.cond, &pool_lock, &deadline);
+
+	pool_stats.waiting -= 1;
+
+	// A connection handed over just as we timed out is still ours to use
+	ret = waiter.vk;
+	if (ret) {
+		record_checkout(elapsed_us(&start));
+	}
+	else {
+		remove_waiter(&waiter);
+		pool_stats.timeouts += 1;
+	}
 
+	pthread_mutex_unlock(&pool_lock);
+	pthread_cond_destroy(&waiter.cond);
+
+	if (!ret) {
+		DEBUG("timed out after %ums waiting for valkey\n", pool_timeout_ms);
+		return NULL;
+	}
+
+	check_connection(ret);
 	return ret;
 }
 
+/**
+ * Return a connection, handing it directly to the longest waiting thread if there
+ * is one
+ */
 void release_valkey(struct valkey_t *vk) {
-	do {
-		vk->next = READ_RELAXED(&vk_list);
-	} while (!CAS_RELAXED(&vk_list, vk->next, vk));
+	struct pool_waiter *waiter;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stats.in_use -= 1;
+
+	waiter = wait_head;
+	if (waiter) {
+		wait_head = waiter->next;
+		if (!wait_head)
+			wait_tail = NULL;
+
+		waiter->vk = vk;
+		pthread_cond_signal(&waiter->cond);
+	}
+	else {
+		vk->next = vk_list;
+		vk_list = vk;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void valkey_pool_stats(struct valkey_pool_stats *out) {
+	pthread_mutex_lock(&pool_lock);
+	*out = pool_stats;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * After a failed read, decide whether it is worth trying again: only when the
+ * connection itself failed, since valkey answering with an error will answer the
+ * same way next time, and only for a bounded number of attempts. The caller then
+ * releases the connection and checks out another, which reconnects it if needed.
+ * Only safe for commands that can be repeated without changing anything.
+ */
+bool valkey_retry(struct valkey_t *vk, size_t attempt) {
+	if (!vk->ctx->err || attempt + 1 >= VALKEY_READ_ATTEMPTS)
+		return false;
+
+	DEBUG("valkey read failed: %s, retrying\n", vk->ctx->errstr);
+	return true;
+}
+
+void valkey_batch_init(struct valkey_batch *batch, struct valkey_t *vk) {
+	memset(batch, 0, sizeof(*batch));
+	batch->vk = vk;
+}
+
+/**
+ * Queue a command in the connection's output buffer without sending it. A command
+ * that cannot be queued fails the whole batch when it is run.
+ */
+void valkey_batch_add(struct valkey_batch *batch, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	valkey_batch_vadd(batch, fmt, args);
+	va_end(args);
+}
+
+void valkey_batch_vadd(struct valkey_batch *batch, const char *fmt, va_list args) {
+	ASSERT(batch->n < VALKEY_BATCH_MAX);
+
+	if (valkeyvAppendCommand(batch->vk->ctx, fmt, args) != VALKEY_OK)
+		batch->failed = true;
+	else
+		batch->n += 1;
+}
+
+void valkey_batch_add_argv(struct valkey_batch *batch, int argc, const char **argv,
+	const size_t *argvlen)
+{
+	ASSERT(batch->n < VALKEY_BATCH_MAX);
+
+	if (valkeyAppendCommandArgv(batch->vk->ctx, argc, argv, argvlen) != VALKEY_OK)
+		batch->failed = true;
+	else
+		batch->n += 1;
+}
+
+/**
+ * Send every queued command and wait for all of their replies. Every reply is
+ * read even after a failure so that the connection is left with nothing pending,
+ * and the first error is returned.
+ */
+error_t *valkey_batch_run(struct valkey_batch *batch) {
+	valkeyContext *ctx = batch->vk->ctx;
+	valkeyReply *bad = NULL;
+	bool failed = batch->failed;
+
+	for (size_t i = 0; i < batch->n; ++i) {
+		if (valkeyGetReply(ctx, (void **) &batch->replies[i]) != VALKEY_OK) {
+			batch->replies[i] = NULL;
+			failed = true;
+			break;
+		}
+
+		if (!bad && batch->replies[i]->type == VALKEY_REPLY_ERROR) {
+			bad = batch->replies[i];
+			failed = true;
+		}
+	}
+
+	if (failed)
+		return E_VALKEY(ctx, bad);
+	return OK;
+}
+
+void valkey_batch_free(struct valkey_batch *batch) {
+	for (size_t i = 0; i < batch->n; ++i) {
+		if (batch->replies[i])
+			freeReplyObject(batch->replies[i]);
+		batch->replies[i] = NULL;
+	}
+	batch->n = 0;
+}
+
+/**
+ * Register a script with valkey and remember its digest for valkey_eval()
+ */
+error_t *valkey_load_script(struct valkey_script *script) {
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	error_t *ret = OK;
+
+	vk = get_valkey();
+	if (!vk)
+		return E_VALKEY_BUSY;
+
+	reply = valkeyCommand(vk->ctx, "SCRIPT LOAD %s", script->source);
+	if (!reply || reply->type != VALKEY_REPLY_STRING ||
+		reply->len != VALKEY_SHA_LEN - 1)
+	{
+		ret = E_VALKEY(vk->ctx, reply);
+		goto done;
+	}
+
+	memcpy(script->sha, reply->str, VALKEY_SHA_LEN - 1);
+	script->sha[VALKEY_SHA_LEN - 1] = 0;
+
+done:
+	freeReplyObject(reply);
+	release_valkey(vk);
+	return ret;
 }
 
+/**
+ * Run a loaded script with nkeys of argv as its KEYS and the rest as its ARGV.
+ * Lengths are taken from argvlen so that arguments may be binary. If valkey has
+ * lost its script cache, for example after a restart, the source is sent again.
+ */
+valkeyReply *valkey_eval(struct valkey_t *vk, struct valkey_script *script, int nkeys,
+	int argc, const char **argv, const size_t *argvlen)
+{
+	const char *cmd[argc + 3];
+	size_t cmdlen[argc + 3];
+	char nkeys_str[16];
+	valkeyReply *reply;
+
+	snprintf(nkeys_str, sizeof(nkeys_str), "%d", nkeys);
+
+	cmd[0] = "EVALSHA";
+	cmd[1] = script->sha;
+	cmd[2] = nkeys_str;
+	cmdlen[0] = strlen(cmd[0]);
+	cmdlen[1] = strlen(cmd[1]);
+	cmdlen[2] = strlen(cmd[2]);
+
+	for (int i = 0; i < argc; ++i) {
+		cmd[3 + i] = argv[i];
+		cmdlen[3 + i] = argvlen[i];
+	}
+
+	reply = valkeyCommandArgv(vk->ctx, argc + 3, cmd, cmdlen);
+	if (!reply || reply->type != VALKEY_REPLY_ERROR ||
+		strncmp(reply->str, "NOSCRIPT", 8) != 0)
+	{
+		return reply;
+	}
+
+	DEBUG("script %s missing from valkey, sending source\n", script->sha);
+	freeReplyObject(reply);
+
+	cmd[0] = "EVAL";
+	cmd[1] = script->source;
+	cmdlen[0] = strlen(cmd[0]);
+	cmdlen[1] = strlen(cmd[1]);
+	return valkeyCommandArgv(vk->ctx, argc + 3, cmd, cmdlen);
+}
+
+/**
+ * Run a single read only command on a pooled connection, retrying on a fresh
+ * connection if this one fails under it. On success the reply belongs to the
+ * caller, and an error reply from valkey counts as a failure.
+ */
+error_t *valkey_read(valkeyReply **out, const char *fmt, ...) {
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	va_list args;
+	error_t *ret;
+
+	*out = NULL;
+	for (size_t attempt = 0; ; ++attempt) {
+		vk = get_valkey();
+		if (!vk)
+			return E_VALKEY_BUSY;
+
+		va_start(args, fmt);
+		reply = valkeyvCommand(vk->ctx, fmt, args);
+		va_end(args);
+
+		if (reply && reply->type != VALKEY_REPLY_ERROR) {
+			release_valkey(vk);
+			*out = reply;
+			return OK;
+		}
+
+		if (!reply && valkey_retry(vk, attempt)) {
+			release_valkey(vk);
+			continue;
+		}
+
+		ret = E_VALKEY(vk->ctx, reply);
+		freeReplyObject(reply);
+		release_valkey(vk);
+		return ret;
+	}
+}
+
+/**
+ * valkey_read() for a command given as arguments, such as one with a variable
+ * number of keys
+ */
+error_t *valkey_read_argv(valkeyReply **out, int argc, const char **argv,
+	const size_t *argvlen)
+{
+	struct valkey_t *vk;
+	valkeyReply *reply;
+	error_t *ret;
+
+	*out = NULL;
+	for (size_t attempt = 0; ; ++attempt) {
+		vk = get_valkey();
+		if (!vk)
+			return E_VALKEY_BUSY;
+
+		reply = valkeyCommandArgv(vk->ctx, argc, argv, argvlen);
+
+		if (reply && reply->type != VALKEY_REPLY_ERROR) {
+			release_valkey(vk);
+			*out = reply;
+			return OK;
+		}
+
+		if (!reply && valkey_retry(vk, attempt)) {
+			release_valkey(vk);
+			continue;
+		}
+
+		ret = E_VALKEY(vk->ctx, reply);
+		freeReplyObject(reply);
+		release_valkey(vk);
+		return ret;
+	}
+}
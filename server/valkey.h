@@ -1,19 +1,36 @@
 #ifndef _VALKEY_H_
 #define _VALKEY_H_
 
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <valkey/valkey.h>
 
 #include <libgjm/binary_map.h>
 #include <libgjm/debug.h>
 #include <libgjm/errors.h>
 
-// valkey pool affects how many concurrent connections we can handle
+// valkey pool affects how many concurrent connections we can handle, these are the
+// defaults until changed with valkey_set_pool_size() and valkey_set_pool_timeout()
 #define VALKEY_POOL_SIZE 16
+#define VALKEY_POOL_TIMEOUT_MS 2000
 #define VALKEY_SOCKET_PATH "/tmp/berghain.sock"
 
+// Connections idle for longer than this are checked with a PING before use
+#define VALKEY_IDLE_CHECK_MS 5000
+
+// Broken connections are reconnected on checkout, waiting between failed attempts
+// from the minimum backoff doubling up to the maximum
+#define VALKEY_BACKOFF_MIN_MS 50
+#define VALKEY_BACKOFF_MAX_MS 5000
+
+// Attempts made at idempotent reads when the connection fails under them
+#define VALKEY_READ_ATTEMPTS 3
+
 // @todo actually should be a cfg to play nice with other modules but for now
 // this error id is available in this project
 #define ERROR_ID_VALKEY ERROR_USER_ID(0)
+#define ERROR_ID_VALKEY_BUSY ERROR_USER_ID(1)
 
 // __error is designed for statically allocated strings, but reply and ctx can both
 // be deallocated so we dump the error to DEBUG and return a generic message in
@@ -22,13 +39,87 @@
 	({ DEBUG("valkey error: %s\n", reply ? reply->str  : ctx->errstr); \
 		__error(ERROR_ID_VALKEY, NULL, ERROR_ARG(0, 0, 0, NULL)); })
 
+// Timed out waiting for a pooled connection
+#define E_VALKEY_BUSY __error(ERROR_ID_VALKEY_BUSY, NULL, ERROR_ARG(0, 0, 0, NULL))
+
+// Pool wait times are bucketed by log2 of microseconds waited, with everything
+// past the last bucket counted in it
+#define VALKEY_WAIT_BUCKETS 24
+
+// Most commands that can be queued in a single batch
+#define VALKEY_BATCH_MAX 8
+
+// sha1 hex digest of a script plus null terminator
+#define VALKEY_SHA_LEN 41
+
 struct valkey_t {
 	valkeyContext *ctx;
 	struct valkey_t *next;
+
+	// Monotonic milliseconds of the last checkout, and the earliest time another
+	// reconnect may be tried after failures in a row
+	uint64_t last_used;
+	uint64_t retry_at;
+	uint32_t failures;
 };
 
+/**
+ * A server side lua script, loaded once at startup and afterwards run by its digest
+ * so that the source is not resent with every call
+ */
+struct valkey_script {
+	const char *source;
+	char sha[VALKEY_SHA_LEN];
+};
+
+/**
+ * Pool counters, copied out under the pool lock so they are consistent. Bucket i
+ * of wait counts checkouts that waited less than 2^i microseconds and at least
+ * 2^(i-1), so bucket 0 is every checkout that found a connection free.
+ */
+struct valkey_pool_stats {
+	size_t size;
+	size_t in_use;
+	size_t waiting;
+	uint64_t checkouts;
+	uint64_t timeouts;
+	uint64_t reconnects;
+	uint64_t wait[VALKEY_WAIT_BUCKETS];
+};
+
+/**
+ * Independent commands queued on one connection and sent together, so that they
+ * cost a single round trip. Replies are filled in by valkey_batch_run() in the order
+ * the commands were added, and stay valid until valkey_batch_free().
+ */
+struct valkey_batch {
+	struct valkey_t *vk;
+	size_t n;
+	bool failed;
+	valkeyReply *replies[VALKEY_BATCH_MAX];
+};
+
+void valkey_set_pool_size(size_t size);
+void valkey_set_pool_timeout(unsigned int ms);
 error_t *init_valkey(void);
 struct valkey_t *get_valkey(void);
 void release_valkey(struct valkey_t *vk);
+void valkey_pool_stats(struct valkey_pool_stats *out);
+bool valkey_retry(struct valkey_t *vk, size_t attempt);
+error_t *valkey_read(valkeyReply **out, const char *fmt, ...);
+error_t *valkey_read_argv(valkeyReply **out, int argc, const char **argv,
+	const size_t *argvlen);
+
+void valkey_batch_init(struct valkey_batch *batch, struct valkey_t *vk);
+void valkey_batch_add(struct valkey_batch *batch, const char *fmt, ...);
+void valkey_batch_vadd(struct valkey_batch *batch, const char *fmt, va_list args);
+void valkey_batch_add_argv(struct valkey_batch *batch, int argc, const char **argv,
+	const size_t *argvlen);
+error_t *valkey_batch_run(struct valkey_batch *batch);
+void valkey_batch_free(struct valkey_batch *batch);
+
+error_t *valkey_load_script(struct valkey_script *script);
+valkeyReply *valkey_eval(struct valkey_t *vk, struct valkey_script *script, int nkeys,
+	int argc, const char **argv, const size_t *argvlen);
 
 #endif